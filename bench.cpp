@@ -0,0 +1,473 @@
+/*
+   Microbenchmarks for the server's request path. servermain.cpp is compiled
+   into this file (without its main()) so the static hot-path functions can
+   be driven directly with synthetic traffic: no sockets, no threads other
+   than the task generator. Replies accumulate in the worker's tx batch and
+   are discarded before it would flush.
+
+   Every benchmark runs at several table occupancies and prints one
+   tab-separated line: benchmark, occupancy, ops, ns/op, allocs/op.
+   With -c <file> each line is compared with the same benchmark and
+   occupancy in an earlier run's output.
+*/
+
+#define SERVER_NO_MAIN
+#include "servermain.cpp"
+
+#include "clientproto.h"
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+
+/* Counts every heap allocation made anywhere in the process. */
+static uint64_t alloc_count;
+
+void *malloc(size_t n) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(n);
+}
+void *calloc(size_t n, size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+void *realloc(void *p, size_t n) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(p, n);
+}
+}
+
+#define BENCH_BATCH 64
+#define MAX_BASELINE 256
+
+static const double occupancies[] = {0.0, 0.25, 0.5, 0.75, 1.0};
+
+static int capacity = 65536;
+static long iterations = 1000000;
+
+struct Baseline {
+  char name[64];
+  double occupancy;
+  double ns;
+};
+static struct Baseline baseline[MAX_BASELINE];
+static int nbaseline;
+
+static volatile int64_t sink;
+
+/* Synthetic client i: 10.x.y.z with a port derived from i. */
+static void client_addr(long i, struct sockaddr_storage *ss, socklen_t *len) {
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  memset(ss, 0, sizeof(*ss));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(0x0a000000u | (uint32_t)(i >> 4));
+  sin->sin_port = htons(1024 + (i & 15));
+  *len = sizeof(*sin);
+}
+
+static void discard_replies(struct Worker *w) { w->tx.count = 0; }
+
+/* Fresh table holding occupied * capacity jobs for clients 0..n-1. */
+static long fill(struct Worker *w, double occupied) {
+  for (int i = 0; i < w->capacity; i++)
+    if (w->jobs[i].active)
+      release_job(w, i);
+  long n = (long)(occupied * w->capacity);
+  for (long i = 0; i < n; i++) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    client_addr(i, &ss, &len);
+    assign_task(w, -1, &ss, len);
+    discard_replies(w);
+  }
+  return n;
+}
+
+static void report(const char *name, double occupancy, long ops,
+                   uint64_t ns, uint64_t allocs) {
+  double per = ops ? (double)ns / ops : 0.0;
+  printf("%s\t%.2f\t%ld\t%.2f\t%.4f", name, occupancy, ops, per,
+         ops ? (double)allocs / ops : 0.0);
+  for (int i = 0; i < nbaseline; i++)
+    if (strcmp(baseline[i].name, name) == 0 &&
+        fabs(baseline[i].occupancy - occupancy) < 1e-9 && baseline[i].ns > 0) {
+      printf("\t%+.1f%%", (per - baseline[i].ns) / baseline[i].ns * 100.0);
+      break;
+    }
+  printf("\n");
+  fflush(stdout);
+}
+
+#define TIMED(name, occ, ops, body)                                            \
+  do {                                                                         \
+    uint64_t a0 = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);             \
+    uint64_t t0 = now_ns();                                                    \
+    body;                                                                      \
+    uint64_t t1 = now_ns();                                                    \
+    uint64_t a1 = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);             \
+    report(name, occ, ops, t1 - t0, a1 - a0);                                  \
+  } while (0)
+
+static void bench_find(struct Worker *w, double occ, long n) {
+  long hits = n > 0 ? n : 1;
+  struct sockaddr_storage *addrs = (struct sockaddr_storage *)__libc_malloc(
+      BENCH_BATCH * sizeof(struct sockaddr_storage));
+  socklen_t len = 0;
+  for (int k = 0; k < BENCH_BATCH; k++)
+    client_addr((k * 7919L) % hits, &addrs[k], &len);
+  TIMED("find_job_addr", occ, iterations, {
+    int64_t acc = 0;
+    for (long i = 0; i < iterations; i++)
+      acc += find_job_addr(w, &addrs[i & (BENCH_BATCH - 1)], len);
+    sink = acc;
+  });
+
+  /* Misses: addresses never assigned. */
+  for (int k = 0; k < BENCH_BATCH; k++)
+    client_addr(w->capacity * 16L + k, &addrs[k], &len);
+  TIMED("find_job_addr_miss", occ, iterations, {
+    int64_t acc = 0;
+    for (long i = 0; i < iterations; i++)
+      acc += find_job_addr(w, &addrs[i & (BENCH_BATCH - 1)], len);
+    sink = acc;
+  });
+  free(addrs);
+}
+
+static void bench_alloc(struct Worker *w, double occ) {
+  if (w->free_head < 0) {
+    TIMED("alloc_job", occ, iterations, {
+      int64_t acc = 0;
+      for (long i = 0; i < iterations; i++)
+        acc += alloc_job(w);
+      sink = acc;
+    });
+    return;
+  }
+  /* Pop a slot and push it straight back, as release_job() would. */
+  TIMED("alloc_job", occ, iterations, {
+    int64_t acc = 0;
+    for (long i = 0; i < iterations; i++) {
+      int slot = alloc_job(w);
+      acc += slot;
+      w->jobs[slot].next = w->free_head;
+      w->free_head = slot;
+    }
+    sink = acc;
+  });
+}
+
+static void bench_assign(struct Worker *w, double occ, long n) {
+  struct sockaddr_storage ss;
+  socklen_t len;
+  if (n == 0) {
+    /* Empty table: assign to one client over and over (replace path). */
+    client_addr(0, &ss, &len);
+    TIMED("assign_task", occ, iterations, {
+      for (long i = 0; i < iterations; i++) {
+        assign_task(w, -1, &ss, len);
+        if (w->tx.count == w->tx.cap)
+          discard_replies(w);
+      }
+    });
+    fill(w, 0.0);
+    return;
+  }
+  /* Clients that already hold a job: occupancy stays where it is. */
+  TIMED("assign_task", occ, iterations, {
+    for (long i = 0; i < iterations; i++) {
+      client_addr(i % n, &ss, &len);
+      assign_task(w, -1, &ss, len);
+      if (w->tx.count == w->tx.cap)
+        discard_replies(w);
+    }
+  });
+  discard_replies(w);
+  if (w->free_head < 0) {
+    client_addr(w->capacity * 16L, &ss, &len);
+    TIMED("assign_task_full", occ, iterations, {
+      for (long i = 0; i < iterations; i++) {
+        assign_task(w, -1, &ss, len);
+        if (w->tx.count == w->tx.cap)
+          discard_replies(w);
+      }
+    });
+    discard_replies(w);
+  }
+}
+
+/* A request then a correct result from each of a chunk of clients, with
+   the table topped back up after every chunk. Each op is one
+   handle_packet() call, timed and recorded the way worker_main() does. */
+static void bench_handle(struct Worker *w, double occ, long n) {
+  long clients = n > BENCH_BATCH ? n : BENCH_BATCH;
+  if (clients > w->capacity)
+    clients = w->capacity;
+  struct calcMessage req;
+  build_init_msg(&req);
+  static struct calcProtocol results[BENCH_BATCH];
+  struct sockaddr_storage addrs[BENCH_BATCH];
+  socklen_t len = 0;
+
+  uint64_t req_ns = 0, res_ns = 0, req_allocs = 0, res_allocs = 0;
+  long done = 0;
+  while (done < iterations) {
+    int k = BENCH_BATCH;
+    for (int j = 0; j < k; j++)
+      client_addr((done + j) % clients, &addrs[j], &len);
+
+    uint64_t a0 = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    uint64_t t0 = now_ns();
+    for (int j = 0; j < k; j++) {
+      uint64_t h0 = now_ns();
+      handle_packet(w, -1, (const char *)&req, sizeof(req), &addrs[j], len);
+      record_handle_time(w, now_ns() - h0);
+    }
+    uint64_t t1 = now_ns();
+    req_ns += t1 - t0;
+    req_allocs += __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - a0;
+
+    /* Untimed: solve the tasks the way a client would. */
+    for (int j = 0; j < k; j++) {
+      struct calcProtocol task;
+      decode_task(w->tx.bufs[j], &task);
+      calculate(&task);
+      encode_reply(&task, &results[j]);
+    }
+    discard_replies(w);
+
+    a0 = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    t0 = now_ns();
+    for (int j = 0; j < k; j++) {
+      uint64_t h0 = now_ns();
+      handle_packet(w, -1, (const char *)&results[j], sizeof(results[j]),
+                    &addrs[j], len);
+      record_handle_time(w, now_ns() - h0);
+    }
+    t1 = now_ns();
+    res_ns += t1 - t0;
+    res_allocs += __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - a0;
+    discard_replies(w);
+
+    /* Untimed: give clients that started out with a job a new one. */
+    for (int j = 0; j < k; j++)
+      if ((done + j) % clients < n)
+        assign_task(w, -1, &addrs[j], len);
+    discard_replies(w);
+    done += k;
+  }
+  report("handle_packet_request", occ, done, req_ns, req_allocs);
+  report("handle_packet_result", occ, done, res_ns, res_allocs);
+}
+
+/* All jobs expire at once; ns/op is per expired job. */
+static void bench_expire(struct Worker *w, double occ) {
+  /* What the event loop does on a wakeup with nothing due. */
+  TIMED("expire_jobs_idle", occ, iterations, {
+    uint64_t acc = 0;
+    for (long i = 0; i < iterations; i++) {
+      expire_jobs(w);
+      acc += wheel_deadline_ms(w);
+    }
+    sink = (int64_t)acc;
+  });
+  long expired = 0;
+  for (int i = 0; i < w->capacity; i++)
+    if (w->jobs[i].active) {
+      wheel_remove(w, i);
+      w->jobs[i].assigned_at -= JOB_TIMEOUT_MS;
+      wheel_insert(w, i, job_expiry_tick(w, i));
+      expired++;
+    }
+  /* The idle runs above moved the wheel to the next tick; let it come due. */
+  usleep(2 * WHEEL_TICK_MS * 1000);
+  TIMED("expire_jobs", occ, expired, expire_jobs(w));
+  if (w->wheel_count != 0)
+    printf("# expire_jobs left %d jobs on the wheel\n", w->wheel_count);
+}
+
+static void bench_compute(void) {
+  enum { N = 4096 };
+  static uint32_t ariths[N];
+  static int32_t i1[N], i2[N], ires[N], igot[N];
+  static double f1[N], f2[N], fres[N], fgot[N];
+  calcCtx rng;
+  calc_ctx_init(&rng, 1);
+  for (int i = 0; i < N; i++) {
+    ariths[i] = 1 + (calc_ctx_arith(&rng) - 1) % 4;
+    i1[i] = calc_ctx_int(&rng);
+    i2[i] = calc_ctx_int(&rng);
+    f1[i] = calc_ctx_float(&rng);
+    f2[i] = calc_ctx_float(&rng);
+  }
+  TIMED("compute_int", 0.0, iterations, {
+    int64_t acc = 0;
+    for (long i = 0; i < iterations; i++) {
+      long k = i & (N - 1);
+      acc += calc_int(ariths[k], i1[k], i2[k]);
+    }
+    sink = acc;
+  });
+  TIMED("compute_double", 0.0, iterations, {
+    double acc = 0;
+    for (long i = 0; i < iterations; i++) {
+      long k = i & (N - 1);
+      acc += calc_double(ariths[k] + 4, f1[k], f2[k]);
+    }
+    sink = (int64_t)acc;
+  });
+
+  /* Mixed operators from here on, as the generator and batches see them. */
+  for (int i = 0; i < N; i++)
+    ariths[i] = calc_ctx_arith(&rng);
+  TIMED("solve_scalar", 0.0, iterations, {
+    for (long i = 0; i < iterations; i += N)
+      for (int k = 0; k < N; k++) {
+        ires[k] = ariths[k] <= 4 ? calc_int(ariths[k], i1[k], i2[k]) : 0;
+        fres[k] = ariths[k] > 4 ? calc_double(ariths[k], f1[k], f2[k]) : 0;
+      }
+    sink = ires[0];
+  });
+  TIMED("solve_array", 0.0, iterations, {
+    for (long i = 0; i < iterations; i += N)
+      calc_solve(ariths, i1, i2, f1, f2, ires, fres, N);
+    sink = ires[0];
+  });
+  for (int i = 0; i < N; i++) {
+    igot[i] = ires[i] + (i % 7 == 0);
+    fgot[i] = fres[i] + (i % 5 == 0 ? 1e-3 : 1e-9);
+  }
+  TIMED("check_scalar", 0.0, iterations, {
+    uint64_t acc = 0;
+    for (long i = 0; i < iterations; i += CALC_BATCH_MAX) {
+      long k = i & (N - 1);
+      acc += calc_check_scalar(ariths + k, ires + k, igot + k, fres + k,
+                               fgot + k, CALC_BATCH_MAX);
+    }
+    sink = (int64_t)acc;
+  });
+  TIMED("check_array", 0.0, iterations, {
+    uint64_t acc = 0;
+    for (long i = 0; i < iterations; i += CALC_BATCH_MAX) {
+      long k = i & (N - 1);
+      acc += calc_check(ariths + k, ires + k, igot + k, fres + k, fgot + k,
+                        CALC_BATCH_MAX);
+    }
+    sink = (int64_t)acc;
+  });
+}
+
+/* Admission checks with both limits on: a few known sources with tokens
+   to spare, then a flood of new addresses (10.x/8, 256 per subnet) that
+   evicts a bucket on nearly every call. */
+static void bench_admit(struct Worker *w) {
+  boot_config.source.rate = boot_config.source.burst = RL_MAX;
+  boot_config.subnet.rate = boot_config.subnet.burst = RL_MAX;
+  rl_source = rl_table_new();
+  rl_subnet = rl_table_new();
+  struct sockaddr_storage addrs[BENCH_BATCH];
+  socklen_t len;
+  for (int k = 0; k < BENCH_BATCH; k++)
+    client_addr(k * 16L, &addrs[k], &len);
+  TIMED("admit", 0.0, iterations, {
+    int64_t acc = 0;
+    for (long i = 0; i < iterations; i++)
+      acc += admit(w, &addrs[i & (BENCH_BATCH - 1)]);
+    sink = acc;
+  });
+  TIMED("admit_flood", 0.0, iterations, {
+    int64_t acc = 0;
+    struct sockaddr_storage ss;
+    for (long i = 0; i < iterations; i++) {
+      client_addr(i * 16, &ss, &len);
+      acc += admit(w, &ss);
+    }
+    sink = acc;
+  });
+  free(rl_source);
+  free(rl_subnet);
+  rl_source = rl_subnet = NULL;
+  boot_config.source.rate = boot_config.subnet.rate = 0;
+}
+
+static void load_baseline(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    printf("ERROR: cannot open %s\n", path);
+    exit(1);
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) && nbaseline < MAX_BASELINE) {
+    struct Baseline *b = &baseline[nbaseline];
+    long ops;
+    if (sscanf(line, "%63s %lf %ld %lf", b->name, &b->occupancy, &ops,
+               &b->ns) == 4)
+      nbaseline++;
+  }
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:c:")) != -1) {
+    switch (opt) {
+    case 'm':
+      capacity = atoi(optarg);
+      break;
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    case 'c':
+      load_baseline(optarg);
+      break;
+    default:
+      printf("Usage: %s [-m sessions] [-n iterations] [-c baseline.tsv]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+  if (capacity < 1 || iterations < 1)
+    return 1;
+
+  uint32_t bucket_mask;
+  size_t arena_size = shard_bytes(capacity, &bucket_mask);
+  int huge;
+  char *arena = (char *)arena_alloc(&arena_size, 0, &huge);
+  struct Worker *w =
+      arena ? worker_create(0, 1, capacity, bucket_mask, arena, BENCH_BATCH, 1)
+            : NULL;
+  if (!w) {
+    printf("ERROR: setup failed\n");
+    return 1;
+  }
+  struct Worker *workers[2] = {w, NULL};
+  all_workers = workers;
+  worker_count = 1;
+  started_ms = now_ms();
+  pthread_t generator;
+  pthread_create(&generator, NULL, generator_main, workers);
+
+  printf("# calc kernel: %s\n", calc_kernel_isa_name());
+  printf("# benchmark\toccupancy\tops\tns_per_op\tallocs_per_op%s\n",
+         nbaseline ? "\tvs_baseline" : "");
+  bench_compute();
+  bench_admit(w);
+  for (size_t o = 0; o < sizeof(occupancies) / sizeof(occupancies[0]); o++) {
+    double occ = occupancies[o];
+    long n = fill(w, occ);
+    bench_find(w, occ, n);
+    bench_alloc(w, occ);
+    bench_assign(w, occ, n);
+    bench_handle(w, occ, n);
+    fill(w, occ);
+    bench_expire(w, occ);
+  }
+
+  pthread_mutex_lock(&refill_lock);
+  generator_stop = 1;
+  pthread_cond_signal(&refill_cond);
+  pthread_mutex_unlock(&refill_lock);
+  pthread_join(generator, NULL);
+  return 0;
+}
@@ -71,3 +71,91 @@ double randomFloat(void){
 };
 
 
+
+
+/* 
+   Context based generator: xoshiro256** (https://prng.di.unimi.it/), seeded
+   through splitmix64 so that any 64-bit seed gives a well mixed state.
+*/
+
+static uint64_t splitmix64(uint64_t *x){
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiro_next(calcCtx *ctx){
+  uint64_t *s = ctx->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+/* Maps the top 32 bits onto [0, range) with a multiply instead of a modulo. */
+static inline uint32_t bounded(calcCtx *ctx, uint32_t range){
+  return (uint32_t)(((xoshiro_next(ctx) >> 32) * range) >> 32);
+}
+
+static inline double unit_float(calcCtx *ctx){
+  return (double)(xoshiro_next(ctx) >> 11) * 0x1.0p-53 * 100.0;
+}
+
+/* calcProtocol arith codes, in the order of arith[] above. */
+static const uint32_t arith_code[]={1,4,3,2,5,8,7,6};
+
+int calc_ctx_init(calcCtx *ctx, uint64_t seed){
+  for(int i=0;i<4;i++)
+    ctx->s[i]=splitmix64(&seed);
+  return(0);
+}
+
+char *calc_ctx_type(calcCtx *ctx){
+  return(arith[bounded(ctx, sizeof(arith)/sizeof(char*))]);
+}
+
+uint32_t calc_ctx_arith(calcCtx *ctx){
+  return(arith_code[bounded(ctx, sizeof(arith_code)/sizeof(arith_code[0]))]);
+}
+
+int calc_ctx_int(calcCtx *ctx){
+  return((int)bounded(ctx, 100));
+}
+
+double calc_ctx_float(calcCtx *ctx){
+  return(unit_float(ctx));
+}
+
+uint64_t calc_ctx_u64(calcCtx *ctx){
+  return(xoshiro_next(ctx));
+}
+
+void calc_ctx_fill_types(calcCtx *ctx, char **out, int n){
+  for(int i=0;i<n;i++)
+    out[i]=arith[bounded(ctx, sizeof(arith)/sizeof(char*))];
+}
+
+void calc_ctx_fill_ariths(calcCtx *ctx, uint32_t *out, int n){
+  for(int i=0;i<n;i++)
+    out[i]=arith_code[bounded(ctx, sizeof(arith_code)/sizeof(arith_code[0]))];
+}
+
+void calc_ctx_fill_ints(calcCtx *ctx, int *out, int n){
+  for(int i=0;i<n;i++)
+    out[i]=(int)bounded(ctx, 100);
+}
+
+void calc_ctx_fill_floats(calcCtx *ctx, double *out, int n){
+  for(int i=0;i<n;i++)
+    out[i]=unit_float(ctx);
+}
@@ -5,6 +5,8 @@ extern "C"{
 #ifndef __CALC_LIB
 #define __CALC_LIB
 
+#include <stdint.h>
+
 /* 
 
 This is the header file for the calcLib. It is a C library.
@@ -28,6 +30,31 @@ Implementation in calcLib.c
   double randomFloat(void);// Return a random float between 0.0 and 100.0
 
 
+/*
+  Reentrant API. The functions above share the global rand() state; these keep
+  all generator state (xoshiro256**) in a calcCtx owned by the caller, so each
+  thread can have its own and nothing is locked or shared. Values follow the
+  same ranges as the global versions. The fill functions produce n values per
+  call to amortize the call overhead when generating tasks in bulk.
+*/
+  typedef struct calcCtx {
+    uint64_t s[4];
+  } calcCtx;
+
+  int calc_ctx_init(calcCtx *ctx, uint64_t seed); // Same seed gives the same sequence.
+
+  char* calc_ctx_type(calcCtx *ctx); // Like randomType().
+  uint32_t calc_ctx_arith(calcCtx *ctx); // Operator as a calcProtocol arith code, 1..8.
+  int calc_ctx_int(calcCtx *ctx); // Like randomInt().
+  double calc_ctx_float(calcCtx *ctx); // Like randomFloat().
+  uint64_t calc_ctx_u64(calcCtx *ctx); // Raw 64-bit output, e.g. to seed another calcCtx.
+
+  void calc_ctx_fill_types(calcCtx *ctx, char **out, int n);
+  void calc_ctx_fill_ariths(calcCtx *ctx, uint32_t *out, int n);
+  void calc_ctx_fill_ints(calcCtx *ctx, int *out, int n);
+  void calc_ctx_fill_floats(calcCtx *ctx, double *out, int n);
+
+
 #endif
 
 #ifdef __cplusplus
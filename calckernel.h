@@ -0,0 +1,304 @@
+#ifndef __CALC_KERNEL
+#define __CALC_KERNEL
+
+/*
+   The arithmetic of the calc protocol, shared by the server, the client and
+   the example program: single tasks, arrays of tasks, and checking arrays of
+   results against the expected ones.
+
+   Arrays are structure-of-arrays: arith[], the int32 operands and results,
+   and the double operands and results, one element per task. They go
+   through AVX2 or SSE4.1 when the CPU has them (picked once at run time)
+   and the scalar code otherwise and for the last n % 4 tasks. Every path
+   gives the same bits:
+
+   - Integer add/sub/mul wrap around.
+   - Integer division truncates. It is done in double precision on the SIMD
+     paths, which is exact: |a| < 2^31 < 2^53, so the rounded quotient never
+     crosses an integer. INT32_MIN / -1 gives INT32_MIN.
+   - Division by zero, integer or double (either sign of zero), gives 0.
+   - A double result is accepted within 1e-6 of the expected one; an
+     integer result must be equal.
+   - Unknown operators give 0 in both results. They are checked as integer
+     tasks for arith <= 4 and as double tasks otherwise.
+*/
+
+#include <immintrin.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CALC_KERNEL_TOLERANCE 1e-6
+
+enum { CALC_ISA_SCALAR, CALC_ISA_SSE41, CALC_ISA_AVX2 };
+
+static inline int calc_kernel_detect(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return CALC_ISA_AVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return CALC_ISA_SSE41;
+  return CALC_ISA_SCALAR;
+}
+
+static inline int calc_kernel_isa(void) {
+  static const int isa = calc_kernel_detect();
+  return isa;
+}
+
+static inline const char *calc_kernel_isa_name(void) {
+  static const char *const names[] = {"scalar", "sse4.1", "avx2"};
+  return names[calc_kernel_isa()];
+}
+
+/* One integer task (arith 1..4). */
+static inline int32_t calc_int(uint32_t arith, int32_t a, int32_t b) {
+  switch (arith) {
+  case 1:
+    return (int32_t)((uint32_t)a + (uint32_t)b);
+  case 2:
+    return (int32_t)((uint32_t)a - (uint32_t)b);
+  case 3:
+    return (int32_t)((uint32_t)a * (uint32_t)b);
+  case 4:
+    if (b == 0)
+      return 0;
+    if (b == -1)
+      return (int32_t)(0u - (uint32_t)a);
+    return a / b;
+  default:
+    return 0;
+  }
+}
+
+/* One double task (arith 5..8). */
+static inline double calc_double(uint32_t arith, double a, double b) {
+  switch (arith) {
+  case 5:
+    return a + b;
+  case 6:
+    return a - b;
+  case 7:
+    return a * b;
+  case 8:
+    return b != 0.0 ? a / b : 0.0;
+  default:
+    return 0.0;
+  }
+}
+
+/* Whether a result for one task is right. */
+static inline int calc_result_ok(uint32_t arith, int32_t iwant, int32_t igot,
+                                 double fwant, double fgot) {
+  if (arith <= 4)
+    return iwant == igot;
+  return fabs(fwant - fgot) < CALC_KERNEL_TOLERANCE;
+}
+
+/* Solves n tasks with mixed operators: ires[i] gets the result of integer
+   tasks and fres[i] that of double tasks; the other one is set to 0. */
+static inline void calc_solve_scalar(const uint32_t *arith, const int32_t *i1,
+                                     const int32_t *i2, const double *f1,
+                                     const double *f2, int32_t *ires,
+                                     double *fres, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    ires[i] = calc_int(arith[i], i1[i], i2[i]);
+    fres[i] = calc_double(arith[i], f1[i], f2[i]);
+  }
+}
+
+/* The vector paths work on four tasks at a time: every lane computes all
+   eight operators and keeps the one its arith asks for. That is fewer
+   instructions than sorting the tasks by operator and moving the operands
+   in and out of per-operator runs, and there are no branches to mispredict
+   on a random operator mix. */
+__attribute__((target("sse4.1"))) static inline void
+calc_solve_sse41(const uint32_t *arith, const int32_t *i1, const int32_t *i2,
+                 const double *f1, const double *f2, int32_t *ires,
+                 double *fres, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i op = _mm_loadu_si128((const __m128i *)(arith + i));
+    __m128i a = _mm_loadu_si128((const __m128i *)(i1 + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(i2 + i));
+#define IS(k) _mm_cmpeq_epi32(op, _mm_set1_epi32(k))
+    __m128i q = _mm_unpacklo_epi64(
+        _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(a), _mm_cvtepi32_pd(b))),
+        _mm_cvttpd_epi32(
+            _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(a, 0xee)),
+                       _mm_cvtepi32_pd(_mm_shuffle_epi32(b, 0xee)))));
+    q = _mm_andnot_si128(_mm_cmpeq_epi32(b, _mm_setzero_si128()), q);
+    __m128i r = _mm_and_si128(IS(1), _mm_add_epi32(a, b));
+    r = _mm_or_si128(r, _mm_and_si128(IS(2), _mm_sub_epi32(a, b)));
+    r = _mm_or_si128(r, _mm_and_si128(IS(3), _mm_mullo_epi32(a, b)));
+    r = _mm_or_si128(r, _mm_and_si128(IS(4), q));
+    _mm_storeu_si128((__m128i *)(ires + i), r);
+
+    /* Doubles two lanes at a time; the operator masks widen to 64 bits. */
+    for (int h = 0; h < 4; h += 2) {
+      __m128i oph = h ? _mm_shuffle_epi32(op, 0xee) : op;
+#define ISD(k)                                                                 \
+  _mm_castsi128_pd(_mm_cvtepi32_epi64(_mm_cmpeq_epi32(oph, _mm_set1_epi32(k))))
+      __m128d fa = _mm_loadu_pd(f1 + i + h), fb = _mm_loadu_pd(f2 + i + h);
+      __m128d fq = _mm_andnot_pd(_mm_cmpeq_pd(fb, _mm_setzero_pd()),
+                                 _mm_div_pd(fa, fb));
+      __m128d fr = _mm_and_pd(ISD(5), _mm_add_pd(fa, fb));
+      fr = _mm_or_pd(fr, _mm_and_pd(ISD(6), _mm_sub_pd(fa, fb)));
+      fr = _mm_or_pd(fr, _mm_and_pd(ISD(7), _mm_mul_pd(fa, fb)));
+      fr = _mm_or_pd(fr, _mm_and_pd(ISD(8), fq));
+      _mm_storeu_pd(fres + i + h, fr);
+#undef ISD
+    }
+#undef IS
+  }
+  calc_solve_scalar(arith + i, i1 + i, i2 + i, f1 + i, f2 + i, ires + i,
+                    fres + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void
+calc_solve_avx2(const uint32_t *arith, const int32_t *i1, const int32_t *i2,
+                const double *f1, const double *f2, int32_t *ires,
+                double *fres, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i op = _mm_loadu_si128((const __m128i *)(arith + i));
+    __m128i a = _mm_loadu_si128((const __m128i *)(i1 + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(i2 + i));
+#define IS(k) _mm_cmpeq_epi32(op, _mm_set1_epi32(k))
+#define ISD(k) _mm256_castsi256_pd(_mm256_cvtepi32_epi64(IS(k)))
+    __m128i q = _mm256_cvttpd_epi32(
+        _mm256_div_pd(_mm256_cvtepi32_pd(a), _mm256_cvtepi32_pd(b)));
+    q = _mm_andnot_si128(_mm_cmpeq_epi32(b, _mm_setzero_si128()), q);
+    __m128i r = _mm_and_si128(IS(1), _mm_add_epi32(a, b));
+    r = _mm_or_si128(r, _mm_and_si128(IS(2), _mm_sub_epi32(a, b)));
+    r = _mm_or_si128(r, _mm_and_si128(IS(3), _mm_mullo_epi32(a, b)));
+    r = _mm_or_si128(r, _mm_and_si128(IS(4), q));
+    _mm_storeu_si128((__m128i *)(ires + i), r);
+
+    __m256d fa = _mm256_loadu_pd(f1 + i), fb = _mm256_loadu_pd(f2 + i);
+    __m256d fq = _mm256_andnot_pd(
+        _mm256_cmp_pd(fb, _mm256_setzero_pd(), _CMP_EQ_OQ),
+        _mm256_div_pd(fa, fb));
+    __m256d fr = _mm256_and_pd(ISD(5), _mm256_add_pd(fa, fb));
+    fr = _mm256_or_pd(fr, _mm256_and_pd(ISD(6), _mm256_sub_pd(fa, fb)));
+    fr = _mm256_or_pd(fr, _mm256_and_pd(ISD(7), _mm256_mul_pd(fa, fb)));
+    fr = _mm256_or_pd(fr, _mm256_and_pd(ISD(8), fq));
+    _mm256_storeu_pd(fres + i, fr);
+#undef ISD
+#undef IS
+  }
+  calc_solve_scalar(arith + i, i1 + i, i2 + i, f1 + i, f2 + i, ires + i,
+                    fres + i, n - i);
+}
+
+/* calc_solve_scalar() with the best kernel the CPU has. */
+static inline void calc_solve(const uint32_t *arith, const int32_t *i1,
+                              const int32_t *i2, const double *f1,
+                              const double *f2, int32_t *ires, double *fres,
+                              size_t n) {
+  switch (calc_kernel_isa()) {
+  case CALC_ISA_AVX2:
+    calc_solve_avx2(arith, i1, i2, f1, f2, ires, fres, n);
+    break;
+  case CALC_ISA_SSE41:
+    calc_solve_sse41(arith, i1, i2, f1, f2, ires, fres, n);
+    break;
+  default:
+    calc_solve_scalar(arith, i1, i2, f1, f2, ires, fres, n);
+  }
+}
+
+/* Bit i set where task i's result is right; n <= 64. */
+static inline uint64_t calc_check_scalar(const uint32_t *arith,
+                                         const int32_t *iwant,
+                                         const int32_t *igot,
+                                         const double *fwant,
+                                         const double *fgot, size_t n) {
+  uint64_t bits = 0;
+  for (size_t i = 0; i < n; i++)
+    bits |= (uint64_t)calc_result_ok(arith[i], iwant[i], igot[i], fwant[i],
+                                     fgot[i])
+            << i;
+  return bits;
+}
+
+/* Four lanes at a time: both comparisons for every lane, then each lane
+   keeps the one its operator asks for. */
+__attribute__((target("sse4.1"))) static inline uint64_t
+calc_check_sse41(const uint32_t *arith, const int32_t *iwant,
+                 const int32_t *igot, const double *fwant, const double *fgot,
+                 size_t n) {
+  const __m128i four = _mm_set1_epi32(4);
+  const __m128d tol = _mm_set1_pd(CALC_KERNEL_TOLERANCE);
+  const __m128d sign = _mm_set1_pd(-0.0);
+  uint64_t bits = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i op = _mm_loadu_si128((const __m128i *)(arith + i));
+    __m128i isint = _mm_cmpeq_epi32(_mm_min_epu32(op, four), op);
+    __m128i ieq =
+        _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(iwant + i)),
+                        _mm_loadu_si128((const __m128i *)(igot + i)));
+    __m128d d0 = _mm_andnot_pd(
+        sign, _mm_sub_pd(_mm_loadu_pd(fwant + i), _mm_loadu_pd(fgot + i)));
+    __m128d d1 = _mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(fwant + i + 2),
+                                                _mm_loadu_pd(fgot + i + 2)));
+    unsigned fok = (unsigned)_mm_movemask_pd(_mm_cmplt_pd(d0, tol)) |
+                   (unsigned)_mm_movemask_pd(_mm_cmplt_pd(d1, tol)) << 2;
+    unsigned iok = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(ieq));
+    unsigned sel = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(isint));
+    bits |= (uint64_t)((iok & sel) | (fok & ~sel & 0xf)) << i;
+  }
+  if (i < n)
+    bits |= calc_check_scalar(arith + i, iwant + i, igot + i, fwant + i,
+                              fgot + i, n - i)
+            << i;
+  return bits;
+}
+
+__attribute__((target("avx2"))) static inline uint64_t
+calc_check_avx2(const uint32_t *arith, const int32_t *iwant,
+                const int32_t *igot, const double *fwant, const double *fgot,
+                size_t n) {
+  const __m128i four = _mm_set1_epi32(4);
+  const __m256d tol = _mm256_set1_pd(CALC_KERNEL_TOLERANCE);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  uint64_t bits = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i op = _mm_loadu_si128((const __m128i *)(arith + i));
+    __m128i isint = _mm_cmpeq_epi32(_mm_min_epu32(op, four), op);
+    __m128i ieq =
+        _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(iwant + i)),
+                        _mm_loadu_si128((const __m128i *)(igot + i)));
+    __m256d d = _mm256_andnot_pd(
+        sign, _mm256_sub_pd(_mm256_loadu_pd(fwant + i),
+                            _mm256_loadu_pd(fgot + i)));
+    unsigned fok =
+        (unsigned)_mm256_movemask_pd(_mm256_cmp_pd(d, tol, _CMP_LT_OQ));
+    unsigned iok = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(ieq));
+    unsigned sel = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(isint));
+    bits |= (uint64_t)((iok & sel) | (fok & ~sel & 0xf)) << i;
+  }
+  if (i < n)
+    bits |= calc_check_scalar(arith + i, iwant + i, igot + i, fwant + i,
+                              fgot + i, n - i)
+            << i;
+  return bits;
+}
+
+/* Checks n <= 64 results against the expected ones; bit i is task i. */
+static inline uint64_t calc_check(const uint32_t *arith, const int32_t *iwant,
+                                  const int32_t *igot, const double *fwant,
+                                  const double *fgot, size_t n) {
+  switch (calc_kernel_isa()) {
+  case CALC_ISA_AVX2:
+    return calc_check_avx2(arith, iwant, igot, fwant, fgot, n);
+  case CALC_ISA_SSE41:
+    return calc_check_sse41(arith, iwant, igot, fwant, fgot, n);
+  default:
+    return calc_check_scalar(arith, iwant, igot, fwant, fgot, n);
+  }
+}
+
+#endif
@@ -0,0 +1,168 @@
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clientproto.h"
+#include "protocol.h"
+
+/*
+   Polls a running server's counters with a stats query (calcMessage type
+   23) and prints one line per interval: rates since the previous sample,
+   table occupancy and packet handling time percentiles. The server only
+   answers queries from loopback addresses.
+*/
+
+/* Host-order copy of a calcStats reply. */
+struct Sample {
+  unsigned threads;
+  uint64_t uptime_ms;
+  uint64_t packets_in;
+  uint64_t packets_out;
+  uint64_t sessions_assigned;
+  uint64_t sessions_ok;
+  uint64_t sessions_failed;
+  uint64_t sessions_expired;
+  uint64_t sessions_rejected;
+  uint64_t sessions_active;
+  uint64_t sessions_capacity;
+  uint64_t handle_ns[CALC_STATS_HIST];
+};
+
+static int query(int sock, struct Sample *st) {
+  static constexpr struct calcMessage q = calc_msg_image(23, 0, 17, 0);
+  if (send(sock, &q, sizeof(q), 0) != sizeof(q))
+    return -1;
+
+  struct pollfd pfd = {sock, POLLIN, 0};
+  if (poll(&pfd, 1, 1000) <= 0)
+    return -1;
+  char buf[1500];
+  ssize_t n = recv(sock, buf, sizeof(buf), 0);
+  if (n != sizeof(struct calcStats))
+    return -1;
+  struct calcStats s;
+  wire_decode(&s, buf);
+  if (s.type != 3)
+    return -1;
+
+  st->threads = s.threads;
+#define FIELD(f) st->f = s.f
+  FIELD(uptime_ms);
+  FIELD(packets_in);
+  FIELD(packets_out);
+  FIELD(sessions_assigned);
+  FIELD(sessions_ok);
+  FIELD(sessions_failed);
+  FIELD(sessions_expired);
+  FIELD(sessions_rejected);
+  FIELD(sessions_active);
+  FIELD(sessions_capacity);
+#undef FIELD
+  memcpy(st->handle_ns, s.handle_ns, sizeof(st->handle_ns));
+  return 0;
+}
+
+/* Upper bound of the histogram bucket holding the pct-th percentile. */
+static uint64_t percentile(const uint64_t *now, const uint64_t *prev,
+                           double pct) {
+  uint64_t total = 0;
+  for (int b = 0; b < CALC_STATS_HIST; b++)
+    total += now[b] - prev[b];
+  if (total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(pct / 100.0 * total + 0.5), seen = 0;
+  for (int b = 0; b < CALC_STATS_HIST; b++) {
+    seen += now[b] - prev[b];
+    if (seen >= rank && seen > 0)
+      return (uint64_t)2 << b;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  double interval = 1.0;
+  long count = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atof(optarg);
+      break;
+    case 'n':
+      count = atol(optarg);
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (argc - optind != 1 || interval <= 0) {
+    printf("Usage: %s [-i seconds] [-n samples] <IP-or-DNS:PORT>\n",
+           argv[0]);
+    return 1;
+  }
+
+  char *colon = strrchr(argv[optind], ':');
+  if (!colon) {
+    printf("ERROR:MISSING COLON. PROPER USAGE host:port\n");
+    return 1;
+  }
+  *colon = '\0';
+  struct sockaddr_storage server_addr;
+  socklen_t server_len;
+  int family;
+  if (resolve_addr(argv[optind], atoi(colon + 1), &server_addr, &server_len,
+                   &family) < 0)
+    return 1;
+  int sock = socket(family, SOCK_DGRAM, 0);
+  if (sock < 0 ||
+      connect(sock, (struct sockaddr *)&server_addr, server_len) < 0) {
+    printf("ERROR:SOCKET\n");
+    return 1;
+  }
+
+  struct Sample prev, cur;
+  if (query(sock, &prev) < 0) {
+    printf("ERROR: no stats reply\n");
+    return 1;
+  }
+  printf("%d threads, up %.1fs, capacity %llu\n", prev.threads,
+         prev.uptime_ms / 1000.0, (unsigned long long)prev.sessions_capacity);
+  printf("%9s %9s %9s %9s %9s %9s %9s %9s %6s %9s %9s\n", "in/s", "out/s",
+         "assign/s", "ok/s", "fail/s", "expire/s", "reject/s", "active",
+         "occ%", "p50_ns", "p99_ns");
+
+  for (long i = 0; count < 0 || i < count; i++) {
+    usleep((useconds_t)(interval * 1e6));
+    if (query(sock, &cur) < 0) {
+      printf("ERROR: no stats reply\n");
+      continue;
+    }
+    double dt = (cur.uptime_ms - prev.uptime_ms) / 1000.0;
+    if (dt <= 0)
+      dt = interval;
+#define RATE(f) ((cur.f - prev.f) / dt)
+    printf("%9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9llu %6.1f %9llu "
+           "%9llu\n",
+           RATE(packets_in), RATE(packets_out), RATE(sessions_assigned),
+           RATE(sessions_ok), RATE(sessions_failed), RATE(sessions_expired),
+           RATE(sessions_rejected), (unsigned long long)cur.sessions_active,
+           cur.sessions_capacity
+               ? 100.0 * cur.sessions_active / cur.sessions_capacity
+               : 0.0,
+           (unsigned long long)percentile(cur.handle_ns, prev.handle_ns, 50),
+           (unsigned long long)percentile(cur.handle_ns, prev.handle_ns, 99));
+#undef RATE
+    fflush(stdout);
+    prev = cur;
+  }
+  close(sock);
+  return 0;
+}
@@ -0,0 +1,167 @@
+#ifndef __CALC_TEXT
+#define __CALC_TEXT
+
+/*
+   Text protocol helpers shared by the server and the client: operator
+   names, a single-pass tokenizer over one line, the task and result lines,
+   and number conversion through std::to_chars/from_chars, which give the
+   shortest form that reads back to the same double and never allocate or
+   look at the locale. Everything works in place on the caller's buffers.
+*/
+
+#include <charconv>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+#define CALC_TEXT_LINE_MAX 128 // longest line either side may send
+
+/* calcProtocol arith code for an operator name, 0 if it isn't one. */
+static inline uint32_t calc_text_arith(const char *s, size_t n) {
+  uint32_t base = 0;
+  if (n == 4 && s[0] == 'f') {
+    base = 4;
+    s++;
+    n--;
+  }
+  if (n != 3)
+    return 0;
+  switch (s[0]) {
+  case 'a':
+    return s[1] == 'd' && s[2] == 'd' ? base + 1 : 0;
+  case 's':
+    return s[1] == 'u' && s[2] == 'b' ? base + 2 : 0;
+  case 'm':
+    return s[1] == 'u' && s[2] == 'l' ? base + 3 : 0;
+  case 'd':
+    return s[1] == 'i' && s[2] == 'v' ? base + 4 : 0;
+  default:
+    return 0;
+  }
+}
+
+static inline const char *calc_text_name(uint32_t arith) {
+  static const char *const names[] = {"",     "add",  "sub",  "mul", "div",
+                                      "fadd", "fsub", "fmul", "fdiv"};
+  return arith <= 8 ? names[arith] : "";
+}
+
+/* Walks the words of one line (without its '\n'). */
+struct calcTextCursor {
+  const char *p;
+  const char *end;
+};
+
+static inline int calc_text_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+/* Next word into tok/len; 0 at the end of the line. */
+static inline int calc_text_token(struct calcTextCursor *c, const char **tok,
+                                  size_t *len) {
+  while (c->p < c->end && calc_text_space(*c->p))
+    c->p++;
+  *tok = c->p;
+  while (c->p < c->end && !calc_text_space(*c->p))
+    c->p++;
+  *len = c->p - *tok;
+  return *len > 0;
+}
+
+/* Next word as a number; 0 if there is none or it isn't all number. */
+template <typename T>
+static inline int calc_text_number(struct calcTextCursor *c, T *v) {
+  const char *tok;
+  size_t len;
+  if (!calc_text_token(c, &tok, &len))
+    return 0;
+  std::from_chars_result r = std::from_chars(tok, tok + len, *v);
+  return r.ec == std::errc() && r.ptr == tok + len;
+}
+
+/* 1 if nothing but blanks is left. */
+static inline int calc_text_done(struct calcTextCursor *c) {
+  const char *tok;
+  size_t len;
+  return !calc_text_token(c, &tok, &len);
+}
+
+/* Writes v at p (end is the buffer end) and returns the next free byte. */
+template <typename T>
+static inline char *calc_text_put(char *p, char *end, T v) {
+  return std::to_chars(p, end, v).ptr;
+}
+
+static inline char *calc_text_str(char *p, char *end, const char *s) {
+  while (*s && p < end)
+    *p++ = *s++;
+  return p;
+}
+
+/* The task line "<id> <op> <value1> <value2>\n" for a host-order task into
+   buf (CALC_TEXT_LINE_MAX bytes); returns its length. */
+static inline size_t calc_text_task(char *buf, const struct calcProtocol *t) {
+  char *end = buf + CALC_TEXT_LINE_MAX;
+  char *p = calc_text_put(buf, end, t->id);
+  p = calc_text_str(p, end, " ");
+  p = calc_text_str(p, end, calc_text_name(t->arith));
+  p = calc_text_str(p, end, " ");
+  if (t->arith <= 4) {
+    p = calc_text_put(p, end, t->inValue1);
+    p = calc_text_str(p, end, " ");
+    p = calc_text_put(p, end, t->inValue2);
+  } else {
+    p = calc_text_put(p, end, t->flValue1);
+    p = calc_text_str(p, end, " ");
+    p = calc_text_put(p, end, t->flValue2);
+  }
+  p = calc_text_str(p, end, "\n");
+  return p - buf;
+}
+
+/* Reads a task line (without '\n') into a host-order task. */
+static inline int calc_text_parse_task(const char *line, size_t n,
+                                       struct calcProtocol *t) {
+  struct calcTextCursor c = {line, line + n};
+  const char *tok;
+  size_t len;
+  uint32_t id;
+  int32_t i1 = 0, i2 = 0;
+  double f1 = 0, f2 = 0;
+  if (!calc_text_number(&c, &id) || !calc_text_token(&c, &tok, &len))
+    return 0;
+  uint32_t arith = calc_text_arith(tok, len);
+  int ok = arith != 0 && (arith <= 4 ? calc_text_number(&c, &i1) &&
+                                           calc_text_number(&c, &i2)
+                                     : calc_text_number(&c, &f1) &&
+                                           calc_text_number(&c, &f2));
+  if (!ok || !calc_text_done(&c))
+    return 0;
+  memset(t, 0, sizeof(*t));
+  t->id = id;
+  t->arith = arith;
+  t->inValue1 = i1;
+  t->inValue2 = i2;
+  t->flValue1 = f1;
+  t->flValue2 = f2;
+  return 1;
+}
+
+/* The result line "<id> <result>\n" for a solved task; returns its
+   length. */
+static inline size_t calc_text_result(char *buf,
+                                      const struct calcProtocol *t) {
+  char *end = buf + CALC_TEXT_LINE_MAX;
+  char *p = calc_text_put(buf, end, t->id);
+  p = calc_text_str(p, end, " ");
+  if (t->arith <= 4)
+    p = calc_text_put(p, end, t->inResult);
+  else
+    p = calc_text_put(p, end, t->flResult);
+  p = calc_text_str(p, end, "\n");
+  return p - buf;
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __CALC_WIRE
+#define __CALC_WIRE
+
+/*
+   Byte order conversion for the packed structs in protocol.h, generated
+   from one field list per struct. The list names every field and says
+   whether it is converted (integers) or sent as is (the doubles); a
+   static_assert fails the build if a field is added to a struct but not
+   to its list. From the lists:
+     wire_decode(&host, buf)  wire bytes at buf to a host-order struct
+     wire_encode(buf, &host)  host-order struct to wire bytes at buf
+     wire_image(host)         constexpr, the wire form as a struct
+   decode and encode read or write the I/O buffer directly, one field at a
+   time, and may be given the same memory for both sides. wire_image()
+   builds constant messages at compile time.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+#include "protocol.h"
+
+/* Network byte order of one integer; its own inverse. */
+template <typename T> constexpr T wire_order(T v) {
+  static_assert(std::is_integral<T>::value, "only integers are converted");
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return v;
+#else
+  if constexpr (sizeof(T) == 1)
+    return v;
+  else if constexpr (sizeof(T) == 2)
+    return (T)__builtin_bswap16((uint16_t)v);
+  else if constexpr (sizeof(T) == 4)
+    return (T)__builtin_bswap32((uint32_t)v);
+  else
+    return (T)__builtin_bswap64((uint64_t)v);
+#endif
+}
+
+template <typename S, typename T> constexpr size_t wire_member_size(T S::*) {
+  return sizeof(T);
+}
+
+/* An integer field, or an array of them. */
+template <auto M> struct WireInt {
+  static constexpr size_t size = wire_member_size(M);
+  template <typename S> static constexpr void convert(S &dst, const S &src) {
+    using T = std::remove_reference_t<decltype(dst.*M)>;
+    if constexpr (std::is_array<T>::value) {
+      for (size_t i = 0; i < std::extent<T>::value; i++)
+        (dst.*M)[i] = wire_order((src.*M)[i]);
+    } else {
+      dst.*M = wire_order(src.*M);
+    }
+  }
+};
+
+/* A field sent in host byte order. */
+template <auto M> struct WireRaw {
+  static constexpr size_t size = wire_member_size(M);
+  template <typename S> static constexpr void convert(S &dst, const S &src) {
+    dst.*M = src.*M;
+  }
+};
+
+template <typename S, typename... F> struct WireLayout {
+  static_assert((F::size + ...) == sizeof(S),
+                "wire field list does not cover the struct");
+  static constexpr void convert(S &dst, const S &src) {
+    (F::convert(dst, src), ...);
+  }
+};
+
+template <typename S> struct Wire;
+
+template <>
+struct Wire<calcProtocol>
+    : WireLayout<calcProtocol, WireInt<&calcProtocol::type>,
+                 WireInt<&calcProtocol::major_version>,
+                 WireInt<&calcProtocol::minor_version>,
+                 WireInt<&calcProtocol::id>, WireInt<&calcProtocol::arith>,
+                 WireInt<&calcProtocol::inValue1>,
+                 WireInt<&calcProtocol::inValue2>,
+                 WireInt<&calcProtocol::inResult>,
+                 WireRaw<&calcProtocol::flValue1>,
+                 WireRaw<&calcProtocol::flValue2>,
+                 WireRaw<&calcProtocol::flResult>> {};
+
+template <>
+struct Wire<calcMessage>
+    : WireLayout<calcMessage, WireInt<&calcMessage::type>,
+                 WireInt<&calcMessage::message>,
+                 WireInt<&calcMessage::protocol>,
+                 WireInt<&calcMessage::major_version>,
+                 WireInt<&calcMessage::minor_version>> {};
+
+template <>
+struct Wire<calcBatch>
+    : WireLayout<calcBatch, WireInt<&calcBatch::type>,
+                 WireInt<&calcBatch::major_version>,
+                 WireInt<&calcBatch::minor_version>,
+                 WireInt<&calcBatch::count>, WireInt<&calcBatch::id>> {};
+
+template <>
+struct Wire<calcBatchVerdict>
+    : WireLayout<calcBatchVerdict, WireInt<&calcBatchVerdict::type>,
+                 WireInt<&calcBatchVerdict::message>,
+                 WireInt<&calcBatchVerdict::protocol>,
+                 WireInt<&calcBatchVerdict::major_version>,
+                 WireInt<&calcBatchVerdict::minor_version>,
+                 WireInt<&calcBatchVerdict::count>,
+                 WireInt<&calcBatchVerdict::bitmap>> {};
+
+template <>
+struct Wire<calcStats>
+    : WireLayout<calcStats, WireInt<&calcStats::type>,
+                 WireInt<&calcStats::major_version>,
+                 WireInt<&calcStats::minor_version>,
+                 WireInt<&calcStats::threads>,
+                 WireInt<&calcStats::uptime_ms>,
+                 WireInt<&calcStats::packets_in>,
+                 WireInt<&calcStats::packets_out>,
+                 WireInt<&calcStats::sessions_assigned>,
+                 WireInt<&calcStats::sessions_ok>,
+                 WireInt<&calcStats::sessions_failed>,
+                 WireInt<&calcStats::sessions_expired>,
+                 WireInt<&calcStats::sessions_rejected>,
+                 WireInt<&calcStats::sessions_active>,
+                 WireInt<&calcStats::sessions_capacity>,
+                 WireInt<&calcStats::handle_ns>> {};
+
+/* The structs are packed, so buf needs no alignment. */
+template <typename S> static inline void wire_decode(S *host, const void *buf) {
+  Wire<S>::convert(*host, *(const S *)buf);
+}
+
+template <typename S> static inline void wire_encode(void *buf, const S *host) {
+  Wire<S>::convert(*(S *)buf, *host);
+}
+
+template <typename S> constexpr S wire_image(const S &host) {
+  S w{};
+  Wire<S>::convert(w, host);
+  return w;
+}
+
+/* A version 1 calcMessage in wire order. */
+constexpr calcMessage calc_msg_image(uint16_t type, uint32_t message,
+                                     uint16_t protocol,
+                                     uint16_t minor_version) {
+  calcMessage m{};
+  m.type = type;
+  m.message = message;
+  m.protocol = protocol;
+  m.major_version = 1;
+  m.minor_version = minor_version;
+  return wire_image(m);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __CAPTURE
+#define __CAPTURE
+
+/*
+   Traffic capture file written by the server's --capture option and read
+   by replay. It is a captureHeader and then captureRecords until the end
+   of the file. Each record is followed directly by its len payload bytes;
+   there is no padding or alignment. The integer fields are in host byte
+   order, so a capture is meant to be read on the machine that took it. The
+   exception is port, which is kept in network order as in a sockaddr.
+
+   Workers buffer records and append a whole buffer at a time, so records
+   from different workers can appear out of time order. Sort by t_ns for a
+   single timeline.
+*/
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "CALCCAP1"
+#define CAPTURE_IN 0  // datagram the server received
+#define CAPTURE_OUT 1 // datagram the server sent
+
+struct __attribute__((__packed__)) captureHeader {
+  char magic[8];     // CAPTURE_MAGIC, no terminator
+  uint64_t start_ns; // wall clock (CLOCK_REALTIME) when the capture started
+};
+
+struct __attribute__((__packed__)) captureRecord {
+  uint64_t t_ns;    // since start_ns, on the monotonic clock
+  uint8_t dir;      // CAPTURE_IN or CAPTURE_OUT
+  uint8_t family;   // AF_INET or AF_INET6
+  uint16_t port;    // the peer's port, network byte order
+  uint8_t addr[16]; // the peer's address; IPv4 uses the first 4 bytes
+  uint16_t len;     // payload bytes that follow
+};
+
+#endif
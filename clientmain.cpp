@@ -1,114 +1,572 @@
+#include "calctext.h"
+#include "clientproto.h"
 #include "protocol.h"
 #include <arpa/inet.h>
 #include <calcLib.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-static ssize_t send_with_retry(int sock, const void *buf, size_t len,
-                               void *rbuf, size_t rlen, struct sockaddr *server,
-                               socklen_t slen, struct sockaddr *from,
-                               socklen_t *flen) {
-  const int max_attempts = 3;
-  const int timeout = 2;
+/* Retransmission timeout after RFC 6298, kept for the whole session: a
+   smoothed RTT and its variance from replies to first transmissions only
+   (Karn's rule), RTO = SRTT + max(G, 4 RTTVAR) within [min_ms, max_ms],
+   doubled on every timeout until the next sample. A retransmission waits
+   up to RTO_JITTER longer at random, so clients that lost packets together
+   do not all retry together. */
+#define RTO_INITIAL_MS 1000
+#define RTO_GRANULARITY_MS 1 // poll() resolution
+#define RTO_JITTER 0.25
+
+struct Rto {
+  double srtt_ms, rttvar_ms; // valid once samples > 0
+  double rto_ms;
+  double min_ms, max_ms; // -m, -M
+  int attempts;          // -a: transmissions per request
+  unsigned long sent, retransmitted, timeouts, samples;
+  unsigned long deferred; // retry-after hints waited out
+};
+
+static struct Rto rto = {0, 0, RTO_INITIAL_MS, 100, 4000, 3, 0, 0, 0, 0};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double rto_clamp(double ms) {
+  return ms < rto.min_ms ? rto.min_ms : ms > rto.max_ms ? rto.max_ms : ms;
+}
+
+static void rto_sample(double rtt_ms) {
+  if (rto.samples++ == 0) {
+    rto.srtt_ms = rtt_ms;
+    rto.rttvar_ms = rtt_ms / 2;
+  } else {
+    double err = rto.srtt_ms - rtt_ms;
+    rto.rttvar_ms = 0.75 * rto.rttvar_ms + 0.25 * (err < 0 ? -err : err);
+    rto.srtt_ms = 0.875 * rto.srtt_ms + 0.125 * rtt_ms;
+  }
+  double var = 4 * rto.rttvar_ms;
+  rto.rto_ms = rto_clamp(rto.srtt_ms +
+                         (var > RTO_GRANULARITY_MS ? var : RTO_GRANULARITY_MS));
+}
+
+static void print_rto_stats(void) {
+  if (rto.sent == 0)
+    return;
+  fflush(stdout);
+  fprintf(stderr, "Retransmissions: %lu of %lu datagrams, %lu timeouts; ",
+          rto.retransmitted, rto.sent, rto.timeouts);
+  if (rto.samples)
+    fprintf(stderr, "srtt %.3f ms, rttvar %.3f ms, ", rto.srtt_ms,
+            rto.rttvar_ms);
+  else
+    fprintf(stderr, "no RTT samples, ");
+  fprintf(stderr, "rto %.0f ms\n", rto.rto_ms);
+  if (rto.deferred)
+    fprintf(stderr, "Server busy: asked again %lu times after a retry-after "
+                    "hint\n",
+            rto.deferred);
+}
+
+/* What an exchange takes as its reply. The first three answer a session
+   request. */
+enum { REPLY_TASK, REPLY_BATCH, REPLY_TEXT_TASK, REPLY_VERDICT,
+       REPLY_BATCH_VERDICT, REPLY_TEXT_VERDICT };
+
+struct Expect {
+  int kind;       /* REPLY_* */
+  uint16_t count; /* tasks in the batch a REPLY_BATCH_VERDICT is for */
+};
+
+/* Whether the datagram in buf (n bytes) is a reply e takes: 2 for a task
+   or batch, whose id goes to *id, 1 for a verdict, 0 for anything else,
+   which is late, for an earlier request, or not from a server at all. */
+static int reply_fits(const struct Expect *e, const char *buf, size_t n,
+                      uint32_t *id) {
+  int verdict = 0;
+  if (n == sizeof(struct calcMessage)) {
+    struct calcMessage msg;
+    wire_decode(&msg, buf);
+    uint32_t m = msg.message & 0xffff;
+    verdict = msg.type == 2 && (m == 1 || m == 2);
+  }
+  switch (e->kind) {
+  case REPLY_TASK: {
+    struct calcProtocol task;
+    if (n != sizeof(task))
+      return verdict;
+    decode_task(buf, &task);
+    *id = task.id;
+    return task.type == 1 ? 2 : 0;
+  }
+  case REPLY_BATCH: {
+    struct calcBatch hdr;
+    if (n < sizeof(hdr) + sizeof(struct calcProtocol))
+      return verdict;
+    wire_decode(&hdr, buf);
+    *id = hdr.id;
+    return hdr.type == 1 && hdr.count >= 1 && hdr.count <= CALC_BATCH_MAX &&
+                   n == sizeof(hdr) + hdr.count * sizeof(struct calcProtocol)
+               ? 2
+               : 0;
+  }
+  case REPLY_BATCH_VERDICT: {
+    struct calcBatchVerdict v;
+    if (n != sizeof(v))
+      return verdict;
+    wire_decode(&v, buf);
+    return v.type == 2 && v.count == e->count;
+  }
+  case REPLY_TEXT_TASK:
+  case REPLY_TEXT_VERDICT: {
+    if (n == 0 || buf[n - 1] != '\n')
+      return 0;
+    n--;
+    if (n > 0 && buf[n - 1] == '\r')
+      n--;
+    if (n == 6 && memcmp(buf, "NOT OK", 6) == 0)
+      return 1;
+    if (e->kind == REPLY_TEXT_VERDICT)
+      return n == 2 && memcmp(buf, "OK", 2) == 0;
+    struct calcProtocol task;
+    if (!calc_text_parse_task(buf, n, &task))
+      return 0;
+    *id = task.id;
+    return 2;
+  }
+  }
+  return verdict;
+}
 
-  for (int attempt = 1; attempt <= max_attempts; ++attempt) {
+/* Sends buf and waits for a reply e takes, retransmitting on timeout.
+   Other datagrams are dropped and the wait goes on for what is left of
+   it. Only a reply within the first wait is an RTT sample (Karn). Every
+   copy of a session request gets the server to replace the task, so after
+   a retransmit the task with the newest id is the one to solve: once a
+   reply arrives, the wait is stretched to at least one more RTO for the
+   rest. Returns the reply's length, -2 if none came, or -1 on a socket
+   error. */
+static ssize_t send_with_retry(int sock, const void *buf, size_t len,
+                               void *rbuf, size_t rlen,
+                               const struct Expect *e,
+                               struct sockaddr *server, socklen_t slen,
+                               struct sockaddr *from, socklen_t *flen) {
+  char tmp[1500];
+  ssize_t got = 0;
+  int best = 0;
+  uint32_t best_id = 0;
+  for (int attempt = 1; attempt <= rto.attempts; ++attempt) {
     if (sendto(sock, buf, len, 0, server, slen) != (ssize_t)len)
       return -1;
+    uint64_t sent_ns = now_ns();
+    rto.sent++;
+    double wait_ms = rto.rto_ms;
+    if (attempt > 1) {
+      rto.retransmitted++;
+      wait_ms += wait_ms * RTO_JITTER * (random() / (RAND_MAX + 1.0));
+    }
 
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-    struct timeval tv;
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
-
-    int rv = select(sock + 1, &fds, NULL, NULL, &tv);
-    if (rv > 0) {
-      *flen = sizeof(struct sockaddr_storage);
-      ssize_t got = recvfrom(sock, rbuf, rlen, 0, from, flen);
-      if (got < 0)
+    uint64_t until_ns = sent_ns + (uint64_t)(wait_ms * 1e6);
+    int replies = 0;
+    for (;;) {
+      uint64_t now = now_ns();
+      if (now >= until_ns)
+        break;
+      struct pollfd pfd = {sock, POLLIN, 0};
+      int rv = poll(&pfd, 1, (int)((until_ns - now + 999999) / 1000000));
+      if (rv < 0)
         return -1;
+      if (rv == 0)
+        break;
+      struct sockaddr_storage src;
+      socklen_t src_len = sizeof(src);
+      ssize_t n = recvfrom(sock, tmp, sizeof(tmp), 0,
+                           (struct sockaddr *)&src, &src_len);
+      if (n < 0)
+        return -1;
+      uint32_t id = 0;
+      int fit = (size_t)n <= rlen ? reply_fits(e, tmp, n, &id) : 0;
+      if (fit == 0)
+        continue;
+      if (attempt == 1)
+        rto_sample((now_ns() - sent_ns) / 1e6);
+      if (got == 0 || fit > best || (fit == 2 && (int32_t)(id - best_id) > 0)) {
+        memcpy(rbuf, tmp, n);
+        memcpy(from, &src, src_len);
+        *flen = src_len;
+        got = n;
+        best = fit;
+        best_id = id;
+      }
+      if (e->kind > REPLY_TEXT_TASK || attempt == 1 || ++replies >= attempt)
+        return got;
+      uint64_t grace_ns = now_ns() + (uint64_t)(rto.rto_ms * 1e6);
+      if (replies == 1 && grace_ns > until_ns)
+        until_ns = grace_ns;
+    }
+    if (got > 0)
       return got;
-    } else if (rv < 0)
-      return -1;
+    rto.timeouts++;
+    rto.rto_ms = rto_clamp(rto.rto_ms * 2);
   }
   return -2;
 }
 
-static void calculate(struct calcProtocol *p) {
-
-  if (p->arith == 1)
-    p->inResult = p->inValue1 + p->inValue2;
-  else if (p->arith == 2)
-    p->inResult = p->inValue1 - p->inValue2;
-  else if (p->arith == 3)
-    p->inResult = p->inValue1 * p->inValue2;
-  else if (p->arith == 4)
-    if (p->inValue2 != 0)
-      p->inResult = p->inValue1 / p->inValue2;
-    else
-      p->inResult = 0;
-  else if (p->arith == 5)
-    p->flResult = p->flValue1 + p->flValue2;
-  else if (p->arith == 6)
-    p->flResult = p->flValue1 - p->flValue2;
-  else if (p->arith == 7)
-    p->flResult = p->flValue1 * p->flValue2;
-  else if (p->arith == 8)
-    if (p->flValue2 != 0)
-      p->flResult = p->flValue1 / p->flValue2;
-    else
-      p->flResult = 0;
-  else
-    printf("ERROR:CALCULATING RESULT\n");
+/* send_with_retry() for a session request. A NOT OK that carries a
+   retry-after hint (server --retry-after) is waited out, plus up to
+   RTO_JITTER at random, and the request sent again; at most rto.attempts
+   requests in all. */
+static ssize_t request_session(int sock, const void *buf, size_t len,
+                               void *rbuf, size_t rlen,
+                               const struct Expect *e,
+                               struct sockaddr *server, socklen_t slen,
+                               struct sockaddr *from, socklen_t *flen) {
+  for (int attempt = 1;; ++attempt) {
+    ssize_t n = send_with_retry(sock, buf, len, rbuf, rlen, e, server, slen,
+                                from, flen);
+    uint32_t after = n > 0 ? decode_retry_after(rbuf, n) : 0;
+    if (after == 0 || attempt >= rto.attempts)
+      return n;
+    rto.deferred++;
+    double wait_ms = after + after * RTO_JITTER * (random() / (RAND_MAX + 1.0));
+    poll(NULL, 0, (int)(wait_ms + 0.5));
+  }
 }
 
-static int resolve_addr(const char *host, int port,
-                        struct sockaddr_storage *out, socklen_t *out_len,
-                        int *out_family) {
-  struct addrinfo hints, *res, *rp;
-  char portstr[16];
-  snprintf(portstr, sizeof(portstr), "%d", port);
+/* Minor version 1: asks for k tasks at once and answers them in one go. */
+static int run_batch(int sock, struct sockaddr_storage *server_addr,
+                     socklen_t server_len, int k) {
+  struct calcMessage init_msg;
+  build_batch_init_msg(&init_msg, k);
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_DGRAM;
+  char buf[1500], out[1500];
+  struct sockaddr_storage client;
+  socklen_t client_len = sizeof(client);
 
-  int err = getaddrinfo(host, portstr, &hints, &res);
-  if (err != 0) {
-    printf("ERROR:RESOLVING HOST\n");
+  struct Expect e = {REPLY_BATCH, 0};
+  ssize_t n =
+      request_session(sock, &init_msg, sizeof(init_msg), buf, sizeof(buf), &e,
+                      (struct sockaddr *)server_addr, server_len,
+                      (struct sockaddr *)&client, &client_len);
+  if (n == -2) {
+    printf("ERROR TIMEOUT\n");
+    return 1;
+  }
+  if (n > 0 && decode_verdict(buf, n) == 2) {
+    printf("Server replied: NOT OK\n");
+    return 1;
+  }
+  int count = n > 0 ? solve_batch(buf, n, out) : -1;
+  if (count < 0) {
+    printf("ERROR WRONG SIZE OR INCORRECT PROTOCOL\n");
+    return 1;
+  }
+
+  struct calcBatch hdr;
+  wire_decode(&hdr, buf);
+  printf("Assignment id=%u, %d tasks\n", hdr.id, count);
+
+  client_len = sizeof(client);
+  e.kind = REPLY_BATCH_VERDICT;
+  e.count = (uint16_t)count;
+  n = send_with_retry(sock, out, n, buf, sizeof(buf), &e,
+                      (struct sockaddr *)server_addr, server_len,
+                      (struct sockaddr *)&client, &client_len);
+  if (n == -2 || n < 0) {
+    printf("ERROR WRONG SIZE OR INCORRECT PROTOCOL\n");
+    return 1;
+  }
+
+  uint32_t bitmap = 0;
+  uint32_t m = decode_batch_verdict(buf, n, &bitmap);
+  if (m == 0)
+    m = decode_verdict(buf, n);
+  if (m == 1)
+    printf("Server replied: OK (%d/%d)\n", count, count);
+  else if (m == 2)
+    printf("Server replied: NOT OK (%d/%d)\n", __builtin_popcount(bitmap),
+           count);
+  else {
+    printf("ERROR WRONG SIZE OR INCORRECT PROTOCOL\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int send_all(int sock, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+#define PIPELINE_DEPTH 128 // TCP requests in flight
+
+/* One text protocol message: a task gets its result line appended to out,
+   a verdict line returns 1 (OK) or 2 (NOT OK). -1 if it is neither. */
+static int text_message(const char *line, size_t n, char *out,
+                        size_t *out_len) {
+  if (n > 0 && line[n - 1] == '\r')
+    n--;
+  if (n == 2 && memcmp(line, "OK", 2) == 0)
+    return 1;
+  if (n == 6 && memcmp(line, "NOT OK", 6) == 0)
+    return 2;
+  struct calcProtocol task;
+  if (!calc_text_parse_task(line, n, &task))
     return -1;
+  calculate(&task);
+  *out_len += calc_text_result(out + *out_len, &task);
+  return 0;
+}
+
+/* The same for a binary message; results go out framed. */
+static int binary_message(const char *msg, size_t n, char *out,
+                          size_t *out_len) {
+  uint32_t bitmap, m;
+  char res[1500];
+  if (n == sizeof(struct calcProtocol)) {
+    struct calcProtocol task, reply;
+    decode_task(msg, &task);
+    calculate(&task);
+    encode_reply(&task, &reply);
+    frame_append(out, out_len, &reply, sizeof(reply));
+    return 0;
   }
+  if ((m = decode_verdict(msg, n)) != 0 ||
+      (m = decode_batch_verdict(msg, n, &bitmap)) != 0)
+    return m == 1 ? 1 : 2;
+  if (solve_batch(msg, n, res) > 0) {
+    frame_append(out, out_len, res, n);
+    return 0;
+  }
+  return -1;
+}
 
-  for (rp = res; rp != NULL; rp = rp->ai_next) {
-    if (rp->ai_family == AF_INET6 || rp->ai_family == AF_INET) {
-      memcpy(out, res->ai_addr, res->ai_addrlen);
-      *out_len = res->ai_addrlen;
-      *out_family = res->ai_family;
-      freeaddrinfo(res);
-      return 0;
+/* TCP: pipelines ntasks requests (of k tasks each if k > 0, text lines if
+   text is set) on one connection, up to PIPELINE_DEPTH at a time, answers
+   tasks as they arrive and waits for every verdict. */
+static int run_tcp(struct sockaddr_storage *server_addr, socklen_t server_len,
+                   int family, int ntasks, int k, int text) {
+  int sock = socket(family, SOCK_STREAM, 0);
+  if (sock < 0 ||
+      connect(sock, (struct sockaddr *)server_addr, server_len) < 0) {
+    printf("ERROR:CONNECT\n");
+    return 1;
+  }
+
+  /* One request: a framed calcMessage or a "TASK" line. */
+  char req[32];
+  size_t req_len = 0;
+  if (text) {
+    memcpy(req, "TASK\n", 5);
+    req_len = 5;
+  } else {
+    struct calcMessage init_msg = calc_msg_image(22, k, 6, k > 0);
+    frame_append(req, &req_len, &init_msg, sizeof(init_msg));
+  }
+
+  /* The first window of requests goes out in one write. */
+  static char out[PIPELINE_DEPTH * (2 + 1500)];
+  size_t out_len = 0;
+  int sent = 0;
+  while (sent < ntasks && sent < PIPELINE_DEPTH) {
+    memcpy(out + out_len, req, req_len);
+    out_len += req_len;
+    sent++;
+  }
+  if (send_all(sock, out, out_len) < 0) {
+    printf("ERROR:SEND\n");
+    return 1;
+  }
+
+  static char in[65536];
+  size_t in_len = 0;
+  int ok = 0, not_ok = 0, rc = 0;
+  while (ok + not_ok < ntasks) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, 10000) <= 0) {
+      printf("ERROR TIMEOUT\n");
+      rc = 1;
+      break;
+    }
+    ssize_t n = recv(sock, in + in_len, sizeof(in) - in_len, 0);
+    if (n <= 0) {
+      printf("ERROR:CONNECTION CLOSED\n");
+      rc = 1;
+      break;
+    }
+    in_len += n;
+
+    /* Solve every complete task and batch up the results, plus a new
+       request for each verdict. */
+    size_t off = 0;
+    out_len = 0;
+    for (;;) {
+      const char *msg;
+      size_t mlen, used;
+      if (text) {
+        const char *nl = (const char *)memchr(in + off, '\n', in_len - off);
+        if (!nl)
+          break;
+        msg = in + off;
+        mlen = nl - msg;
+        used = mlen + 1;
+      } else {
+        if (in_len - off < 2)
+          break;
+        const unsigned char *f = (const unsigned char *)in + off;
+        mlen = f[0] << 8 | f[1];
+        if (in_len - off < 2 + mlen)
+          break;
+        msg = in + off + 2;
+        used = 2 + mlen;
+      }
+      int m = text ? text_message(msg, mlen, out, &out_len)
+                   : binary_message(msg, mlen, out, &out_len);
+      if (m < 0) {
+        printf("ERROR WRONG SIZE OR INCORRECT PROTOCOL\n");
+        close(sock);
+        return 1;
+      }
+      if (m == 1)
+        ok++;
+      else if (m == 2)
+        not_ok++;
+      if (m > 0 && sent < ntasks) {
+        memcpy(out + out_len, req, req_len);
+        out_len += req_len;
+        sent++;
+      }
+      off += used;
+    }
+    memmove(in, in + off, in_len - off);
+    in_len -= off;
+    if (out_len > 0 && send_all(sock, out, out_len) < 0) {
+      printf("ERROR:SEND\n");
+      rc = 1;
+      break;
     }
   }
-  freeaddrinfo(res);
-  return -1;
+
+  printf("Server replied: %d OK, %d NOT OK\n", ok, not_ok);
+  close(sock);
+  return rc;
+}
+
+/* Text protocol over UDP: one "TASK" datagram, one result line. */
+static int run_text(int sock, struct sockaddr_storage *server_addr,
+                    socklen_t server_len) {
+  char buf[1500], out[CALC_TEXT_LINE_MAX];
+  struct sockaddr_storage client;
+  socklen_t client_len = sizeof(client);
+
+  struct Expect e = {REPLY_TEXT_TASK, 0};
+  ssize_t n = send_with_retry(sock, "TASK\n", 5, buf, sizeof(buf), &e,
+                              (struct sockaddr *)server_addr, server_len,
+                              (struct sockaddr *)&client, &client_len);
+  if (n == -2) {
+    printf("ERROR TIMEOUT\n");
+    return 1;
+  }
+  size_t out_len = 0;
+  int m = -1;
+  if (n > 0 && buf[n - 1] == '\n')
+    m = text_message(buf, n - 1, out, &out_len);
+  if (m == 2)
+    printf("Server replied: NOT OK\n");
+  if (m != 0) {
+    if (m != 2)
+      printf("ERROR WRONG SIZE OR INCORRECT PROTOCOL\n");
+    return 1;
+  }
+  printf("Assignment %.*s\n", (int)(n - 1), buf);
+
+  client_len = sizeof(client);
+  e.kind = REPLY_TEXT_VERDICT;
+  n = send_with_retry(sock, out, out_len, buf, sizeof(buf), &e,
+                      (struct sockaddr *)server_addr, server_len,
+                      (struct sockaddr *)&client, &client_len);
+  m = -1;
+  if (n > 0 && buf[n - 1] == '\n')
+    m = text_message(buf, n - 1, out, &out_len);
+  if (m == 1)
+    printf("Server replied: OK\n");
+  else if (m == 2)
+    printf("Server replied: NOT OK\n");
+  else {
+    printf("ERROR WRONG SIZE OR INCORRECT PROTOCOL\n");
+    return 1;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
   char *desthost = NULL;
   int destport = 0;
-
-  if (argc < 2) {
-    printf("usage: %s <host> <port>\n", argv[0]);
+  int batch = 0;
+  int tcp = 0;
+  int text = 0;
+  int ntasks = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "k:Ttn:a:m:M:")) != -1) {
+    switch (opt) {
+    case 'k':
+      batch = atoi(optarg);
+      break;
+    case 'T':
+      tcp = 1;
+      break;
+    case 't':
+      text = 1;
+      break;
+    case 'n':
+      ntasks = atoi(optarg);
+      break;
+    case 'a':
+      rto.attempts = atoi(optarg);
+      break;
+    case 'm':
+      rto.min_ms = atof(optarg);
+      break;
+    case 'M':
+      rto.max_ms = atof(optarg);
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (argc - optind < 1 || batch < 0 || batch > CALC_BATCH_MAX ||
+      ntasks < 1 || (ntasks > 1 && !tcp) || (text && batch) ||
+      rto.attempts < 1 || rto.min_ms < RTO_GRANULARITY_MS ||
+      rto.max_ms < rto.min_ms) {
+    printf("usage: %s [-k tasks | -t] [-T [-n requests]] [-a attempts] "
+           "[-m min_rto_ms] [-M max_rto_ms] <host> <port>\n",
+           argv[0]);
     return -1;
   }
+  rto.rto_ms = rto_clamp(RTO_INITIAL_MS);
+  srandom((unsigned)now_ns());
+  atexit(print_rto_stats);
+  /* Positional arguments from here on, as if there were no options. */
+  argc -= optind - 1;
+  argv += optind - 1;
 
   if (argc >= 3) {
     desthost = argv[1];
@@ -154,26 +612,32 @@ int main(int argc, char *argv[]) {
   if (resolve_addr(desthost, destport, &server_addr, &server_len, &family) < 0)
     return -1;
 
+  if (tcp)
+    return run_tcp(&server_addr, server_len, family, ntasks, batch, text);
+
   int sock = socket(family, SOCK_DGRAM, 0);
   if (sock < 0) {
     printf("ERROR:SOCKET");
     return 1;
   }
 
+  if (batch > 0 || text) {
+    int rc = text ? run_text(sock, &server_addr, server_len)
+                  : run_batch(sock, &server_addr, server_len, batch);
+    close(sock);
+    return rc;
+  }
+
   struct calcMessage init_msg;
-  memset(&init_msg, 0, sizeof(init_msg));
-  init_msg.type = htons(22);
-  init_msg.message = htonl(0);
-  init_msg.protocol = htons(17);
-  init_msg.major_version = htons(1);
-  init_msg.minor_version = htons(0);
+  build_init_msg(&init_msg);
 
   char buf[1024];
   struct sockaddr_storage client;
   socklen_t client_len = sizeof(client);
 
+  struct Expect e = {REPLY_TASK, 0};
   ssize_t n =
-      send_with_retry(sock, &init_msg, sizeof(init_msg), buf, sizeof(buf),
+      request_session(sock, &init_msg, sizeof(init_msg), buf, sizeof(buf), &e,
                       (struct sockaddr *)&server_addr, server_len,
                       (struct sockaddr *)&client, &client_len);
 
@@ -189,12 +653,14 @@ int main(int argc, char *argv[]) {
 
   if ((size_t)n == sizeof(struct calcMessage)) {
     struct calcMessage msg;
-    memcpy(&msg, buf, sizeof(msg));
-    uint16_t t = ntohs(msg.type);
-    uint32_t m = ntohl(msg.message);
-    if (t == 2 && m == 2)
+    wire_decode(&msg, buf);
+    uint16_t t = msg.type;
+    uint32_t m = msg.message & 0xffff;
+    if (t == 2 && m == 2) {
       printf("Server replied: NOT OK\n");
-    else if (t == 2 && m == 1) {
+      close(sock);
+      return 1;
+    } else if (t == 2 && m == 1) {
       printf("Server replied: OK (unexpected early OK)\n");
       close(sock);
       return 0;
@@ -210,33 +676,19 @@ int main(int argc, char *argv[]) {
   }
 
   struct calcProtocol task;
-  memcpy(&task, buf, sizeof(task));
-  task.type = ntohs(task.type);
-  task.major_version = ntohs(task.major_version);
-  task.minor_version = ntohs(task.minor_version);
-  task.id = ntohl(task.id);
-  task.arith = ntohl(task.arith);
-  task.inValue1 = ntohl(task.inValue1);
-  task.inValue2 = ntohl(task.inValue2);
-  task.inResult = ntohl(task.inResult);
+  decode_task(buf, &task);
 
   printf("Assignment id=%u arith=%u\n", task.id, task.arith);
 
   calculate(&task);
 
-  struct calcProtocol reply = task;
-  reply.type = htons(2);
-  reply.major_version = htons(task.major_version);
-  reply.minor_version = htons(task.minor_version);
-  reply.id = htonl(task.id);
-  reply.arith = htonl(task.arith);
-  reply.inValue1 = htonl(task.inValue1);
-  reply.inValue2 = htonl(task.inValue2);
-  reply.inResult = htonl(task.inResult);
+  struct calcProtocol reply;
+  encode_reply(&task, &reply);
 
   client_len = sizeof(client);
 
-  n = send_with_retry(sock, &reply, sizeof(reply), buf, sizeof(buf),
+  e.kind = REPLY_VERDICT;
+  n = send_with_retry(sock, &reply, sizeof(reply), buf, sizeof(buf), &e,
                       (struct sockaddr *)&server_addr, server_len,
                       (struct sockaddr *)&client, &client_len);
 
@@ -252,9 +704,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  struct calcMessage finalmsg;
-  memcpy(&finalmsg, buf, sizeof(finalmsg));
-  uint32_t m = ntohl(finalmsg.message);
+  uint32_t m = decode_verdict(buf, n);
   if (m == 1)
     printf("Server replied: OK\n");
   else if (m == 2)
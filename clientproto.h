@@ -0,0 +1,163 @@
+#ifndef __CLIENT_PROTO
+#define __CLIENT_PROTO
+
+/*
+   Client side of the calc protocol, shared by the client and loadgen:
+   address lookup, the handshake message, task decoding, the calculation
+   itself and the reply encoding, for single tasks and task batches.
+   Everything here is static so each program gets its own copy and can
+   inline it.
+*/
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "calckernel.h"
+#include "calcwire.h"
+#include "protocol.h"
+
+static inline void calculate(struct calcProtocol *p) {
+  if (p->arith >= 1 && p->arith <= 4)
+    p->inResult = calc_int(p->arith, p->inValue1, p->inValue2);
+  else if (p->arith >= 5 && p->arith <= 8)
+    p->flResult = calc_double(p->arith, p->flValue1, p->flValue2);
+  else
+    printf("ERROR:CALCULATING RESULT\n");
+}
+
+static inline int resolve_addr(const char *host, int port,
+                               struct sockaddr_storage *out,
+                               socklen_t *out_len, int *out_family) {
+  struct addrinfo hints, *res, *rp;
+  char portstr[16];
+  snprintf(portstr, sizeof(portstr), "%d", port);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  int err = getaddrinfo(host, portstr, &hints, &res);
+  if (err != 0) {
+    printf("ERROR:RESOLVING HOST\n");
+    return -1;
+  }
+
+  for (rp = res; rp != NULL; rp = rp->ai_next) {
+    if (rp->ai_family == AF_INET6 || rp->ai_family == AF_INET) {
+      memcpy(out, rp->ai_addr, rp->ai_addrlen);
+      *out_len = rp->ai_addrlen;
+      *out_family = rp->ai_family;
+      freeaddrinfo(res);
+      return 0;
+    }
+  }
+  freeaddrinfo(res);
+  return -1;
+}
+
+/* The type 22 binary-protocol request that opens a session. */
+static inline void build_init_msg(struct calcMessage *m) {
+  *m = calc_msg_image(22, 0, 17, 0);
+}
+
+/* Request for k tasks in one datagram (minor version 1). */
+static inline void build_batch_init_msg(struct calcMessage *m, uint32_t k) {
+  *m = calc_msg_image(22, k, 17, 1);
+}
+
+/* Wire calcProtocol in buf to host byte order. */
+static inline void decode_task(const void *buf, struct calcProtocol *task) {
+  wire_decode(task, buf);
+}
+
+/* Solved host-order task to the wire reply the server expects, written
+   straight to out. */
+static inline void encode_reply(const struct calcProtocol *task, void *out) {
+  wire_encode(out, task);
+  ((struct calcProtocol *)out)->type = wire_order((uint16_t)2);
+}
+
+/* Solves the task batch datagram in buf (n bytes) into the result datagram
+   at out, which has room for the same n bytes. Returns the task count, or
+   -1 if buf is not a task batch. */
+static inline int solve_batch(const void *buf, size_t n, void *out) {
+  struct calcBatch hdr;
+  if (n < sizeof(hdr))
+    return -1;
+  wire_decode(&hdr, buf);
+  size_t count = hdr.count;
+  if (hdr.type != 1 || count < 1 || count > CALC_BATCH_MAX ||
+      n != sizeof(hdr) + count * sizeof(struct calcProtocol))
+    return -1;
+
+  hdr.type = 2;
+  wire_encode(out, &hdr);
+  const char *in = (const char *)buf + sizeof(hdr);
+  char *res = (char *)out + sizeof(hdr);
+  struct calcProtocol tasks[CALC_BATCH_MAX];
+  uint32_t ariths[CALC_BATCH_MAX];
+  int32_t i1[CALC_BATCH_MAX], i2[CALC_BATCH_MAX], ir[CALC_BATCH_MAX];
+  double f1[CALC_BATCH_MAX], f2[CALC_BATCH_MAX], fr[CALC_BATCH_MAX];
+  for (size_t i = 0; i < count; i++) {
+    decode_task(in + i * sizeof(tasks[i]), &tasks[i]);
+    ariths[i] = tasks[i].arith;
+    i1[i] = tasks[i].inValue1;
+    i2[i] = tasks[i].inValue2;
+    f1[i] = tasks[i].flValue1;
+    f2[i] = tasks[i].flValue2;
+  }
+  calc_solve(ariths, i1, i2, f1, f2, ir, fr, count);
+  for (size_t i = 0; i < count; i++) {
+    tasks[i].inResult = ir[i];
+    tasks[i].flResult = fr[i];
+    encode_reply(&tasks[i], res + i * sizeof(tasks[i]));
+  }
+  return (int)count;
+}
+
+/* Appends msg as one TCP frame at out + *len. */
+static inline void frame_append(char *out, size_t *len, const void *msg,
+                                size_t n) {
+  out[*len] = (char)(n >> 8);
+  out[*len + 1] = (char)(n & 0xff);
+  memcpy(out + *len + 2, msg, n);
+  *len += 2 + n;
+}
+
+/* calcMessage.message of a server verdict, or 0 if buf isn't one. */
+static inline uint32_t decode_verdict(const void *buf, size_t n) {
+  if (n != sizeof(struct calcMessage))
+    return 0;
+  struct calcMessage m;
+  wire_decode(&m, buf);
+  return m.message & 0xffff;
+}
+
+/* The retry-after hint in a NOT OK from a server with no free slot, in
+   milliseconds; 0 if buf carries none. */
+static inline uint32_t decode_retry_after(const void *buf, size_t n) {
+  if (n != sizeof(struct calcMessage))
+    return 0;
+  struct calcMessage m;
+  wire_decode(&m, buf);
+  return (m.message & 0xffff) == 2 ? m.message >> 16 : 0;
+}
+
+/* Like decode_verdict() for a calcBatchVerdict; *bitmap gets the per-task
+   bits. */
+static inline uint32_t decode_batch_verdict(const void *buf, size_t n,
+                                            uint32_t *bitmap) {
+  if (n != sizeof(struct calcBatchVerdict))
+    return 0;
+  struct calcBatchVerdict v;
+  wire_decode(&v, buf);
+  *bitmap = v.bitmap;
+  return v.message;
+}
+
+#endif
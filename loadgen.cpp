@@ -0,0 +1,370 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clientproto.h"
+#include "protocol.h"
+
+/*
+   Load generator for the calc server. Each concurrent session gets its own
+   UDP socket (the server keys sessions by client address) and runs the same
+   handshake / calculate / reply exchange as the client, driven from a single
+   epoll loop. Runs either closed loop (keep -c sessions in flight) or open
+   loop (start -r sessions per second, at most -c in flight).
+*/
+
+#define MAX_EVENTS 256
+#define PKT_BUF 1500
+#define SCAN_MS 10 // timeout scan interval, and the wait after a failed send
+
+/* Log-linear latency histogram in microseconds: exact below 2^HIST_SUB_BITS,
+   then 2^HIST_SUB_BITS buckets per power of two (< 1% relative error). */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum SessionState { IDLE, WAIT_TASK, WAIT_VERDICT };
+
+struct Session {
+  int sock;
+  enum SessionState state;
+  uint64_t started_ns;
+  uint64_t deadline_ns; // while IDLE: not restarted before this
+};
+
+struct Histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+struct Totals {
+  uint64_t started;
+  uint64_t ok;
+  uint64_t not_ok;
+  uint64_t timeout;
+  uint64_t error;
+  uint64_t skipped; // open loop: no free session when one was due
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+  if (v < HIST_SUB)
+    return (int)v;
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+/* Highest value that lands in bucket i. */
+static uint64_t hist_value(int i) {
+  if (i < HIST_SUB)
+    return (uint64_t)i;
+  int shift = i / HIST_SUB - 1;
+  uint64_t base = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+  return base + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_record(struct Histogram *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  h->total++;
+  if (v > h->max)
+    h->max = v;
+}
+
+static uint64_t hist_percentile(const struct Histogram *h, double pct) {
+  if (h->total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(pct / 100.0 * h->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank)
+      return hist_value(i) < h->max ? hist_value(i) : h->max;
+  }
+  return h->max;
+}
+
+/* A connected socket for session i, registered with ep. */
+static int open_socket(int ep, int i, int family,
+                       const struct sockaddr_storage *addr, socklen_t len) {
+  int sock = socket(family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0 || connect(sock, (const struct sockaddr *)addr, len) < 0) {
+    if (sock >= 0)
+      close(sock);
+    return -1;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = i;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+  return sock;
+}
+
+/* Sends the session request; on failure the session rests SCAN_MS before
+   it is tried again. */
+static int start_session(struct Session *s, uint64_t now,
+                         uint64_t timeout_ns) {
+  struct calcMessage init_msg;
+  build_init_msg(&init_msg);
+  if (send(s->sock, &init_msg, sizeof(init_msg), 0) != sizeof(init_msg)) {
+    s->deadline_ns = now + SCAN_MS * 1000000ull;
+    return -1;
+  }
+  s->state = WAIT_TASK;
+  s->started_ns = now;
+  s->deadline_ns = now + timeout_ns;
+  return 0;
+}
+
+static void finish_session(struct Session *s, struct Histogram *h,
+                           uint64_t now) {
+  hist_record(h, (now - s->started_ns) / 1000);
+  s->state = IDLE;
+  s->deadline_ns = now;
+}
+
+/* Advances a session on a received datagram. */
+static void on_datagram(struct Session *s, const char *buf, ssize_t n,
+                        uint64_t now, uint64_t timeout_ns, struct Totals *tot,
+                        struct Histogram *h) {
+  if (s->state == WAIT_TASK && (size_t)n == sizeof(struct calcProtocol)) {
+    struct calcProtocol task, reply;
+    decode_task(buf, &task);
+    calculate(&task);
+    encode_reply(&task, &reply);
+    if (send(s->sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+      tot->error++;
+      s->state = IDLE;
+      s->deadline_ns = now + SCAN_MS * 1000000ull;
+      return;
+    }
+    s->state = WAIT_VERDICT;
+    s->deadline_ns = now + timeout_ns;
+    return;
+  }
+
+  if (s->state == IDLE ||
+      (s->state == WAIT_VERDICT && (size_t)n != sizeof(struct calcMessage)))
+    return; // nothing this exchange is waiting for
+  uint32_t m = decode_verdict(buf, n);
+  if (m == 1 && s->state == WAIT_VERDICT)
+    tot->ok++;
+  else if (m == 2)
+    tot->not_ok++;
+  else
+    tot->error++;
+  finish_session(s, h, now);
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <IP-or-DNS:PORT>\n"
+         "  -c, --concurrency N  sessions in flight (default 100)\n"
+         "  -r, --rate R         open loop: start R sessions/s "
+         "(default: closed loop)\n"
+         "  -d, --duration S     seconds to run (default 10)\n"
+         "  -T, --timeout MS     per-step timeout (default 2000)\n",
+         prog);
+}
+
+int main(int argc, char *argv[]) {
+  int concurrency = 100;
+  double rate = 0;
+  double duration = 10;
+  int timeout_ms = 2000;
+
+  static const struct option opts[] = {
+      {"concurrency", required_argument, NULL, 'c'},
+      {"rate", required_argument, NULL, 'r'},
+      {"duration", required_argument, NULL, 'd'},
+      {"timeout", required_argument, NULL, 'T'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:r:d:T:", opts, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'T':
+      timeout_ms = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || concurrency < 1 || rate < 0 || duration <= 0 ||
+      timeout_ms < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  char *colon = strrchr(argv[optind], ':');
+  if (!colon) {
+    printf("ERROR:MISSING COLON. PROPER USAGE host:port\n");
+    return 1;
+  }
+  *colon = '\0';
+  int port = atoi(colon + 1);
+  struct sockaddr_storage server_addr;
+  socklen_t server_len;
+  int family;
+  if (port <= 0 ||
+      resolve_addr(argv[optind], port, &server_addr, &server_len, &family) < 0)
+    return 1;
+
+  /* One descriptor per session; lift the soft limit as far as allowed. */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  struct Session *sessions =
+      (struct Session *)calloc(concurrency, sizeof(struct Session));
+  struct Histogram *hist = (struct Histogram *)calloc(1, sizeof(*hist));
+  if (ep < 0 || !sessions || !hist)
+    return 1;
+  for (int i = 0; i < concurrency; i++) {
+    sessions[i].sock = open_socket(ep, i, family, &server_addr, server_len);
+    if (sessions[i].sock < 0) {
+      printf("ERROR:SOCKET %d: %s\n", i, strerror(errno));
+      return 1;
+    }
+  }
+
+  struct Totals tot;
+  memset(&tot, 0, sizeof(tot));
+  uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000;
+  uint64_t begin = now_ns();
+  uint64_t end = begin + (uint64_t)(duration * 1e9);
+  uint64_t next_scan = begin;
+  int next_free = 0; // open loop: round-robin search start
+
+  printf("Load: %s:%d, %d sessions, %s", argv[optind], port, concurrency,
+         rate > 0 ? "open loop" : "closed loop");
+  if (rate > 0)
+    printf(" at %.0f/s", rate);
+  printf(", %.1fs\n", duration);
+
+  struct epoll_event evs[MAX_EVENTS];
+  char buf[PKT_BUF];
+  uint64_t now = begin;
+  while (now < end) {
+    /* Start whatever sessions are due. */
+    if (rate > 0) {
+      uint64_t due = (uint64_t)((now - begin) / 1e9 * rate);
+      while (tot.started + tot.skipped < due) {
+        int i, k;
+        for (k = 0, i = next_free; k < concurrency;
+             k++, i = (i + 1) % concurrency)
+          if (sessions[i].state == IDLE && sessions[i].deadline_ns <= now)
+            break;
+        if (k == concurrency) {
+          tot.skipped += due - tot.started - tot.skipped;
+          break;
+        }
+        next_free = (i + 1) % concurrency;
+        if (start_session(&sessions[i], now, timeout_ns) == 0)
+          tot.started++;
+        else {
+          tot.error++;
+          tot.started++;
+        }
+      }
+    } else {
+      for (int i = 0; i < concurrency; i++)
+        if (sessions[i].state == IDLE && sessions[i].deadline_ns <= now) {
+          if (start_session(&sessions[i], now, timeout_ns) < 0)
+            tot.error++;
+          tot.started++;
+        }
+    }
+
+    int wait_ms = SCAN_MS;
+    if (rate > 0) {
+      uint64_t next_due = begin + (uint64_t)((tot.started + tot.skipped + 1) /
+                                             rate * 1e9);
+      if (next_due <= now)
+        wait_ms = 0;
+      else if ((next_due - now) / 1000000 < (uint64_t)wait_ms)
+        wait_ms = (int)((next_due - now) / 1000000);
+    }
+    int nev = epoll_wait(ep, evs, MAX_EVENTS, wait_ms);
+    now = now_ns();
+    for (int e = 0; e < nev; e++) {
+      struct Session *s = &sessions[evs[e].data.u32];
+      ssize_t n;
+      while ((n = recv(s->sock, buf, sizeof(buf), 0)) > 0)
+        on_datagram(s, buf, n, now, timeout_ns, &tot, hist);
+    }
+
+    /* A session that timed out moves to a new socket: a late reply to it
+       then reaches a closed port, not the session after it. The server
+       keys sessions by address, so this also leaves its job behind. */
+    if (now >= next_scan) {
+      for (int i = 0; i < concurrency; i++)
+        if (sessions[i].state != IDLE && sessions[i].deadline_ns <= now) {
+          tot.timeout++;
+          sessions[i].state = IDLE;
+          close(sessions[i].sock);
+          sessions[i].sock =
+              open_socket(ep, i, family, &server_addr, server_len);
+          if (sessions[i].sock < 0) {
+            printf("ERROR:SOCKET %d: %s\n", i, strerror(errno));
+            return 1;
+          }
+        }
+      next_scan = now + SCAN_MS * 1000000ull;
+    }
+  }
+
+  double secs = (now - begin) / 1e9;
+  uint64_t done = tot.ok + tot.not_ok + tot.timeout + tot.error;
+  printf("duration %.2f s, sessions started %llu, completed %llu "
+         "(%.1f/s)\n",
+         secs, (unsigned long long)tot.started, (unsigned long long)done,
+         done / secs);
+  printf("ok %llu, not ok %llu, timeout %llu, error %llu",
+         (unsigned long long)tot.ok, (unsigned long long)tot.not_ok,
+         (unsigned long long)tot.timeout, (unsigned long long)tot.error);
+  if (rate > 0)
+    printf(", skipped %llu", (unsigned long long)tot.skipped);
+  printf("\n");
+  printf("latency us: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+         (unsigned long long)hist_percentile(hist, 50),
+         (unsigned long long)hist_percentile(hist, 99),
+         (unsigned long long)hist_percentile(hist, 99.9),
+         (unsigned long long)hist->max);
+
+  for (int i = 0; i < concurrency; i++)
+    close(sessions[i].sock);
+  close(ep);
+  free(sessions);
+  free(hist);
+  return 0;
+}
@@ -7,6 +7,8 @@
 
 
 #include "protocol.h"
+#include "calctext.h"
+#include "calckernel.h"
 
 
 /* 
@@ -50,30 +52,15 @@ int main(int argc, char *argv[]){
 
     /* At this point, ptr holds operator, f1 and f2 the operands. Now we work to determine the reference result. */
    
-    if(strcmp(ptr,"fadd")==0){
-      fresult=f1+f2;
-    } else if (strcmp(ptr, "fsub")==0){
-      fresult=f1-f2;
-    } else if (strcmp(ptr, "fmul")==0){
-      fresult=f1*f2;
-    } else if (strcmp(ptr, "fdiv")==0){
-      fresult=f1/f2;
-    }
+    /* Look the operator up and compute the result. */
+    fresult=calc_double(calc_text_arith(ptr,strlen(ptr)),f1,f2);
     printf("%s %8.8g %8.8g = %8.8g\n",ptr,f1,f2,fresult);
   } else {
     printf("Int\t");
     i1=randomInt();
     i2=randomInt();
 
-    if(strcmp(ptr,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(ptr, "sub")==0){
-      iresult=i1-i2;
-    } else if (strcmp(ptr, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(ptr, "div")==0){
-      iresult=i1/i2;
-    }
+    iresult=calc_int(calc_text_arith(ptr,strlen(ptr)),i1,i2);
 
     printf("%s %d %d = %d \n",ptr,i1,i2,iresult);
   }
@@ -90,45 +77,33 @@ int main(int argc, char *argv[]){
   
   printf("got:> %s \n",lineBuffer);
 
-  int rv;
-  char command[10];
-
-  
-  rv=sscanf(lineBuffer,"%s",command);
+  /* Split the line into the command and its operands. */
+  if(nread>0 && lineBuffer[nread-1]=='\n'){
+    nread--;
+  }
+  struct calcTextCursor cur={lineBuffer,lineBuffer+(nread>0 ? nread : 0)};
+  const char *command;
+  size_t commandLen;
+  calc_text_token(&cur,&command,&commandLen);
+  uint32_t op=calc_text_arith(command,commandLen);
 
-  printf("Command: |%s|\n",command);
+  printf("Command: |%.*s|\n",(int)commandLen,command);
   
-  if(command[0]=='f'){
+  if(op>4){
     printf("Float\t");
-    rv=sscanf(lineBuffer,"%s %lg %lg",command,&f1,&f2);
-    if(strcmp(command,"fadd")==0){
-      fresult=f1+f2;
-    } else if (strcmp(command, "fsub")==0){
-      fresult=f1-f2;
-    } else if (strcmp(command, "fmul")==0){
-      fresult=f1*f2;
-    } else if (strcmp(command, "fdiv")==0){
-      fresult=f1/f2;
-    }
-    printf("%s %8.8g %8.8g = %8.8g\n",command,f1,f2,fresult);
-  } else {
+    calc_text_number(&cur,&f1);
+    calc_text_number(&cur,&f2);
+    fresult=calc_double(op,f1,f2);
+    printf("%.*s %8.8g %8.8g = %8.8g\n",(int)commandLen,command,f1,f2,fresult);
+  } else if(op>0){
     printf("Int\t");
-    rv=sscanf(lineBuffer,"%s %d %d",command,&i1,&i2);
-    if(strcmp(command,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(command, "sub")==0){
-      iresult=i1-i2;
-      printf("[%s %d %d = %d ]\n",command,i1,i2,iresult);
-    } else if (strcmp(command, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(command, "div")==0){
-      
-      iresult=i1/i2;
-    } else {
-      printf("No match\n");
-    }
-
-    printf("%s %d %d = %d \n",command,i1,i2,iresult);
+    calc_text_number(&cur,&i1);
+    calc_text_number(&cur,&i2);
+    iresult=calc_int(op,i1,i2);
+
+    printf("%.*s %d %d = %d \n",(int)commandLen,command,i1,i2,iresult);
+  } else {
+    printf("No match\n");
   }
   
 
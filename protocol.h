@@ -8,6 +8,8 @@
 
 #endif
 
+#ifndef __CALC_PROTOCOL
+#define __CALC_PROTOCOL
 
 #include <stdint.h>
 
@@ -38,11 +40,102 @@ struct  __attribute__((__packed__)) calcMessage {
   // Protocol, UDP = 17, TCP = 6, other values are reserved. 
   uint16_t protocol; // conversion needed 
   uint16_t major_version; // 1, conversion needed 
-  uint16_t minor_version; // 0 , conversion needed 
+  uint16_t minor_version; // 0, 1 for task batches, conversion needed 
 
 };
 
 
+/*
+   Text protocol (calcMessage.type 21 asks for it over UDP; a line works as
+   well). One message per UDP datagram, or one per line on a TCP connection
+   whose first byte is printable (no length prefix then). Lines end in '\n':
+     client: TASK                        ask for a task
+     server: <id> <op> <value1> <value2> e.g. "17 fmul 12.5 3.25"
+     client: <id> <result>               e.g. "17 40.625"
+     server: OK | NOT OK
+   op is add, sub, mul, div, fadd, fsub, fmul or fdiv. Numbers are plain
+   decimal; floats are written in the shortest form that reads back to the
+   same double.
+*/
+
+/*
+   TCP (calcMessage.protocol = 6, same port as UDP): every message is sent
+   as a 2-byte payload length in network byte order followed by exactly
+   what would have been one UDP datagram. A client may send any number of
+   requests and results without waiting; each request gets its own task
+   (the address alone no longer identifies it, the id does) and every
+   message is answered in the order received.
+*/
+
+/*
+   A server started with --stateless keeps no session for binary tasks.
+   Each task it sends is a cookie: the id is the issue time, and the fields
+   the task does not use carry a MAC. For an integer task that is flValue1;
+   for a float task it is inValue1 and inValue2. Clients must echo every
+   field of the task unchanged, as they already do. Batches carry one
+   cookie per task.
+*/
+
+/*
+   Minor version 1: task batches. A client asks for K tasks at once with a
+   type 22 calcMessage whose minor_version is 1 and whose message is K
+   (1..CALC_BATCH_MAX). The server answers with one datagram: a calcBatch
+   header (type 1) followed by K calcProtocol tasks, each carrying the
+   header's id. The client solves them and sends back the same layout with
+   type 2 and the results filled in, tasks in the order received. The
+   verdict is a calcBatchVerdict; anything that cannot be checked at all
+   (unknown client, wrong id, too late) still gets a plain NOT OK
+   calcMessage. All integer fields need conversion.
+*/
+#define CALC_BATCH_MAX 16
+
+struct  __attribute__((__packed__)) calcBatch {
+  uint16_t type;          // 1 = server to client, 2 = client to server
+  uint16_t major_version; // 1
+  uint16_t minor_version; // 1
+  uint16_t count;         // calcProtocol entries that follow
+  uint32_t id;
+};
+
+/* Starts like a calcMessage; message is 1 only if every task was right. */
+struct  __attribute__((__packed__)) calcBatchVerdict {
+  uint16_t type;    // 2
+  uint32_t message; // 1 = OK, 2 = NOT OK
+  uint16_t protocol;
+  uint16_t major_version; // 1
+  uint16_t minor_version; // 1
+  uint16_t count;
+  uint32_t bitmap; // bit i set: task i was right
+};
+
+
+/*
+   Reply to a stats query (calcMessage.type 23, loopback clients only).
+   type = 3, all integer fields need conversion: 16-bit with ntohs, 64-bit
+   with be64toh. Counters are totals since the server started, summed over
+   all worker threads.
+*/
+#define CALC_STATS_HIST 32
+
+struct  __attribute__((__packed__)) calcStats {
+  uint16_t type;          // 3
+  uint16_t major_version; // 1
+  uint16_t minor_version; // 0
+  uint16_t threads;       // worker threads
+  uint64_t uptime_ms;
+  uint64_t packets_in;
+  uint64_t packets_out;
+  uint64_t sessions_assigned;
+  uint64_t sessions_ok;       // correct result returned
+  uint64_t sessions_failed;   // wrong or late result
+  uint64_t sessions_expired;  // never answered, reclaimed by the timer
+  uint64_t sessions_rejected; // turned away: table full or rate limited
+  uint64_t sessions_active;   // current occupancy
+  uint64_t sessions_capacity;
+  uint64_t handle_ns[CALC_STATS_HIST]; // packets handled in [2^i, 2^(i+1)) ns
+};
+
+
 /* arith mapping in calcProtocol
 1 - add
 2 - sub
@@ -62,10 +155,10 @@ other numbers are reserved
    calcMessage.type
    1 - server-to-client, text protocol
    2 - server-to-client, binary protocol
-   3 - server-to-client, N/A
+   3 - server-to-client, stats reply (struct calcStats)
    21 - client-to-server, text protocol
    22 - client-to-server, binary protocol
-   23 - client-to-serve, N/A
+   23 - client-to-server, stats query
    
    calcMessage.message 
 
@@ -73,4 +166,10 @@ other numbers are reserved
    1 = OK   // Accept 
    2 = NOT OK  // Reject 
 
+   A server run with --retry-after may turn a request for a task away
+   with message = 2 | (ms << 16): NOT OK, no session slot is free, ask
+   again in about ms milliseconds. Only the low 16 bits are the verdict.
+
 */
+
+#endif
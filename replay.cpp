@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "clientproto.h"
+
+/*
+   Sends the datagrams clients sent in a server capture (server --capture)
+   to a server again: at the original pacing, N times faster, or as fast as
+   possible. The capture is memory-mapped and read in place. Every client
+   address in it gets its own UDP socket, so the server sees as many
+   distinct clients as the capture had. Replies are counted, not checked.
+   The server hands out fresh tasks, so captured results mostly come back
+   NOT OK; what is reproduced is the load, not the answers.
+*/
+
+#define MAX_EVENTS 256
+#define SPIN_NS 200000 // closer than this to a send, spin instead of sleep
+#define DRAIN_MS 500   // wait for late replies after the last send
+
+struct Send {
+  uint64_t t_ns;
+  const struct captureRecord *rec;
+  int peer;
+};
+
+struct Peer {
+  uint8_t family;
+  uint16_t port;
+  uint8_t addr[16];
+  int sock;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int by_time(const void *a, const void *b) {
+  const struct Send *x = (const struct Send *)a, *y = (const struct Send *)b;
+  if (x->t_ns != y->t_ns)
+    return x->t_ns < y->t_ns ? -1 : 1;
+  return x->rec < y->rec ? -1 : x->rec > y->rec; // file order on ties
+}
+
+static uint32_t peer_hash(const struct captureRecord *r) {
+  uint32_t h = 2166136261u ^ r->family;
+  h = (h ^ r->port) * 16777619u;
+  for (int i = 0; i < 16; i++)
+    h = (h ^ r->addr[i]) * 16777619u;
+  return h;
+}
+
+/* Reads every reply that has arrived; waits up to timeout_ms for one. */
+static uint64_t drain(int ep, const struct Peer *peers, int timeout_ms) {
+  struct epoll_event evs[MAX_EVENTS];
+  char buf[1500];
+  uint64_t n = 0;
+  int nev = epoll_wait(ep, evs, MAX_EVENTS, timeout_ms);
+  for (int e = 0; e < nev; e++)
+    while (recv(peers[evs[e].data.u32].sock, buf, sizeof(buf), 0) > 0)
+      n++;
+  return n;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <capture-file> <IP-or-DNS:PORT>\n"
+         "  -s, --speed X  replay X times faster than captured (default 1)\n"
+         "  -f, --fast     send as fast as possible, ignoring the pacing\n",
+         prog);
+}
+
+int main(int argc, char *argv[]) {
+  double speed = 1.0;
+  int fast = 0;
+
+  static const struct option opts[] = {{"speed", required_argument, NULL, 's'},
+                                       {"fast", no_argument, NULL, 'f'},
+                                       {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:f", opts, NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 'f':
+      fast = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || speed <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *path = argv[optind];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 ||
+      (size_t)st.st_size < sizeof(struct captureHeader)) {
+    printf("ERROR: cannot read capture %s\n", path);
+    return 1;
+  }
+  size_t size = st.st_size;
+  const char *map =
+      (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED ||
+      memcmp(map, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+    printf("ERROR: %s is not a capture\n", path);
+    return 1;
+  }
+  madvise((void *)map, size, MADV_SEQUENTIAL);
+
+  char *colon = strrchr(argv[optind + 1], ':');
+  if (!colon) {
+    printf("ERROR:MISSING COLON. PROPER USAGE host:port\n");
+    return 1;
+  }
+  *colon = '\0';
+  struct sockaddr_storage server_addr;
+  socklen_t server_len;
+  int family;
+  if (resolve_addr(argv[optind + 1], atoi(colon + 1), &server_addr,
+                   &server_len, &family) < 0)
+    return 1;
+
+  /* The client side of the capture, in time order. */
+  size_t nsends = 0, cap = 1024, truncated = 0;
+  struct Send *sends = (struct Send *)malloc(cap * sizeof(*sends));
+  const char *p = map + sizeof(struct captureHeader), *end = map + size;
+  while (p + sizeof(struct captureRecord) <= end) {
+    const struct captureRecord *r = (const struct captureRecord *)p;
+    if (p + sizeof(*r) + r->len > end) {
+      truncated = 1;
+      break;
+    }
+    p += sizeof(*r) + r->len;
+    if (r->dir != CAPTURE_IN)
+      continue;
+    if (nsends == cap) {
+      cap *= 2;
+      sends = (struct Send *)realloc(sends, cap * sizeof(*sends));
+    }
+    if (!sends)
+      return 1;
+    sends[nsends].t_ns = r->t_ns;
+    sends[nsends].rec = r;
+    nsends++;
+  }
+  if (nsends == 0) {
+    printf("ERROR: no client datagrams in %s\n", path);
+    return 1;
+  }
+  qsort(sends, nsends, sizeof(*sends), by_time);
+
+  /* One socket per captured client address. */
+  size_t mask = 1;
+  while (mask < 2 * nsends)
+    mask <<= 1;
+  mask--;
+  int *slots = (int *)malloc((mask + 1) * sizeof(int));
+  struct Peer *peers = (struct Peer *)malloc(nsends * sizeof(*peers));
+  if (!slots || !peers)
+    return 1;
+  memset(slots, -1, (mask + 1) * sizeof(int));
+  int npeers = 0;
+  for (size_t i = 0; i < nsends; i++) {
+    const struct captureRecord *r = sends[i].rec;
+    size_t s = peer_hash(r) & mask;
+    while (slots[s] >= 0) {
+      const struct Peer *q = &peers[slots[s]];
+      if (q->family == r->family && q->port == r->port &&
+          memcmp(q->addr, r->addr, sizeof(q->addr)) == 0)
+        break;
+      s = (s + 1) & mask;
+    }
+    if (slots[s] < 0) {
+      struct Peer *q = &peers[npeers];
+      q->family = r->family;
+      q->port = r->port;
+      memcpy(q->addr, r->addr, sizeof(q->addr));
+      slots[s] = npeers++;
+    }
+    sends[i].peer = slots[s];
+  }
+  free(slots);
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0)
+    return 1;
+  for (int i = 0; i < npeers; i++) {
+    int sock = socket(family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr *)&server_addr, server_len) < 0) {
+      printf("ERROR:SOCKET %d: %s\n", i, strerror(errno));
+      return 1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+    peers[i].sock = sock;
+  }
+
+  uint64_t first = sends[0].t_ns;
+  double span = (sends[nsends - 1].t_ns - first) / 1e9;
+  printf("Replay: %zu datagrams from %d clients over %.2fs of capture%s, ",
+         nsends, npeers, span, truncated ? " (truncated)" : "");
+  if (fast)
+    printf("as fast as possible\n");
+  else
+    printf("at %gx\n", speed);
+
+  uint64_t sent = 0, errors = 0, replies = 0, max_lag = 0;
+  uint64_t begin = now_ns();
+  for (size_t i = 0; i < nsends; i++) {
+    if (!fast) {
+      uint64_t due = begin + (uint64_t)((sends[i].t_ns - first) / speed);
+      uint64_t now;
+      while ((now = now_ns()) + SPIN_NS < due)
+        replies += drain(ep, peers, (int)((due - now - SPIN_NS) / 1000000));
+      while ((now = now_ns()) < due)
+        ;
+      if (now - due > max_lag)
+        max_lag = now - due;
+    }
+    const struct captureRecord *r = sends[i].rec;
+    if (send(peers[sends[i].peer].sock, r + 1, r->len, 0) == r->len)
+      sent++;
+    else
+      errors++;
+    if ((i & 63) == 63)
+      replies += drain(ep, peers, 0);
+  }
+  double secs = (now_ns() - begin) / 1e9;
+  uint64_t until = now_ns() + DRAIN_MS * 1000000ull;
+  while (now_ns() < until)
+    replies += drain(ep, peers, DRAIN_MS / 10);
+
+  printf("sent %llu in %.2fs (%.0f/s), send errors %llu, replies %llu\n",
+         (unsigned long long)sent, secs, sent / (secs > 0 ? secs : 1),
+         (unsigned long long)errors, (unsigned long long)replies);
+  if (!fast)
+    printf("pacing: worst send %.1f us late\n", max_lag / 1000.0);
+
+  for (int i = 0; i < npeers; i++)
+    close(peers[i].sock);
+  close(ep);
+  free(peers);
+  free(sends);
+  munmap((void *)map, size);
+  return 0;
+}
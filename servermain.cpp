@@ -1,292 +1,2706 @@
 #include <arpa/inet.h>
-#include <math.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "calckernel.h"
+#include "calctext.h"
+#include "calcwire.h"
+#include "capture.h"
 #include "protocol.h"
+#include "siphash.h"
+#include "uring.h"
 #include <calcLib.h>
 
-#define MAX_JOBS 256
-#define JOB_TIMEOUT 10
+#define MAX_SESSIONS_DEFAULT 256
+#define MAX_SESSIONS_LIMIT 0x40000000 // keeps slot indices in an int
+#define JOB_TIMEOUT_MS 10000   // default; --config can change it
+#define JOB_TIMEOUT_MAX 3600000 // well inside the wheel and the cookie clock
+#define ARENA_ALIGN 64
+#define HUGE_PAGE_SIZE (2u << 20)
 
-volatile sig_atomic_t terminate_flag = 0;
-volatile sig_atomic_t housekeeping_flag = 0;
+/* Hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots each,
+   level 0 ticking every WHEEL_TICK_MS (10ms .. ~46h horizon). */
+#define WHEEL_TICK_MS 10
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+
+/* Datagrams drained per wakeup and replies flushed per sendmmsg(). */
+#define BATCH_DEFAULT 64
+#define BATCH_MAX 1024
+#define PKT_MAX 1500
+
+#define MAX_SOCKS 8 // one per address the listen name resolves to
+#define MAX_EVENTS 16
+#define MAX_THREADS 256
+
+/* What main() adds to a worker's eventfd; both can be pending at once. */
+#define WAKE_STOP 1
+#define WAKE_CONFIG ((uint64_t)1 << 32)
+#define CONFIG_WAIT_MS 1000 // for every worker to take up a reload
+
+/* TCP (calcMessage.protocol 6): connections per worker and their stream
+   buffers. Replies to everything read in one wakeup leave in one send(). */
+#define CONN_MAX 1024
+#define CONN_IN 4096   // room for at least one full frame
+#define CONN_OUT 65536 // coalesced replies; reading stops while this is full
+#define FRAME_HDR 2    // big-endian payload length before every message
+
+/* An integer task's cookie tag rides in flValue1 as a double in [1, 2). */
+#define COOKIE_ONE 0x3ff0000000000000ull
+#define COOKIE_MANT 0x000fffffffffffffull
+
+/* Admission control (-r, -R): token buckets per source address and per
+   subnet, each in a set-associative table of RL_SETS cache lines that all
+   workers share. Tokens are kept in thousandths, so a rate of R per second
+   adds exactly R of them per millisecond. */
+#define RL_SETS 1024 // per table, power of two
+#define RL_WAYS 4    // buckets per 64-byte set
+#define RL_UNIT 1000 // one token
+#define RL_MAX 1000000 // largest rate or burst
+#define RL_V4_PREFIX 24
+#define RL_V6_PREFIX 64
+
+/* -q: a UDP session request that finds the table full waits in a FIFO of
+   up to WAIT_MAX per worker until a slot frees up or the delay runs out.
+   An open-addressed index of WAIT_INDEX slots finds a client's place by
+   address. -a: NOT OK for such a request carries a retry-after hint in the
+   upper half of calcMessage.message. */
+#define WAIT_MAX 1024 // power of two
+#define WAIT_INDEX (2 * WAIT_MAX)
+#define RETRY_AFTER_MAX 65535
+
+#define CAPTURE_BUF (1 << 20) // per worker, appended to the file when full
+#define CAPTURE_FLUSH_MS 1000 // or on a timer tick once this old
+
+/* --state-file: the session arena is a shared mapping of a file, after a
+   StateHeader page, so a restarted server carries on with the sessions
+   the last one handed out. */
+#define STATE_MAGIC "CALCJOBS"
+#define STATE_VERSION 2
+#define STATE_HEADER 4096 // keeps the shards page aligned
+
+/* io_uring backend. Each provided buffer holds the io_uring_recvmsg_out
+   header, the source address and one datagram. */
+#define UR_SQ_ENTRIES 1024
+#define UR_CQ_ENTRIES 8192
+#define UR_BUFS 1024 // per worker, power of two
+#define UR_BUF_SIZE 2048
+#define UR_BGID 0
+#define UR_TAG(kind, i) ((uint64_t)(kind) << 32 | (uint32_t)(i))
+enum { UR_RECV = 1, UR_SEND, UR_POLL, UR_DONE };
+
+/* Ready-made tasks per worker, refilled by the generator thread once a
+   worker drains its ring below POOL_LOW_WATER. */
+#define POOL_SIZE 4096 // power of two
+#define POOL_LOW_WATER (POOL_SIZE / 2)
+#define POOL_CHUNK 256 // tasks generated per bulk calcLib call
 
 struct Job {
   int active;
+  int next; // hash chain while active, free list while inactive
+  uint32_t hash;
   struct sockaddr_storage addr;
   socklen_t addr_len;
   uint32_t id;
-  struct calcProtocol task;
-  time_t assigned_at;
+  uint32_t arith;
+  int32_t iexp; // expected result, precomputed with the task
+  double fexp;
+  uint32_t ntasks; // task batch (minor version 1) size, 0 for a single task
+  uint64_t seed;   // batch tasks are regenerated from this to check them
+  int tcp; // handed out over TCP: keyed by address and id, not address only
+  uint64_t assigned_at; // monotonic ms
+  int tprev, tnext;     // timer wheel slot list
+  int wslot;            // level * WHEEL_SLOTS + slot
+};
+
+struct PacketBatch {
+  int count;
+  int cap;
+  int sock; // socket the queued datagrams go out on (tx only)
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+  struct sockaddr_storage *addrs;
+  char (*bufs)[PKT_MAX];
+};
+
+/* How a worker moves UDP datagrams and tells the time. The server runs on
+   udp_transport: recvmmsg()/sendmmsg() and the monotonic clock. sim puts
+   an in-memory network with a virtual clock in its place, so the same
+   request path runs without the kernel. The io_uring backend does its own
+   I/O but still reads the transport's clock. */
+struct Worker;
+struct Transport {
+  /* Sends the tx->count datagrams queued in tx; returns how many left. */
+  int (*send)(struct Worker *w, struct PacketBatch *tx);
+  /* Fills rx with up to rx->cap datagrams waiting on sock, without
+     blocking; returns how many. */
+  int (*recv)(struct Worker *w, int sock, struct PacketBatch *rx);
+  /* Monotonic nanoseconds; coarse is only good to a scheduler tick. */
+  uint64_t (*clock_ns)(int coarse);
+};
+
+/* A TCP client. The slot is free while fd is -1; buffers only exist while
+   it is in use. */
+struct Conn {
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint32_t events; // epoll interest currently registered
+  int text;        // -1 until the first byte: lines instead of frames
+  char *in;
+  int in_len;
+  char *out;
+  int out_len; // bytes queued
+  int out_off; // of which already sent
+};
+
+struct PooledTask {
+  struct calcProtocol wire; // network byte order; id is patched in on use
+  uint32_t arith;
+  int32_t iexp;
+  double fexp;
 };
 
-static struct Job jobs[MAX_JOBS];
+/* Single-producer/single-consumer ring: the generator thread advances
+   tail, the owning worker advances head. */
+struct TaskPool {
+  struct PooledTask *ring;
+  calcCtx rng; // generator thread only
+  alignas(64) uint64_t head;
+  alignas(64) uint64_t tail;
+  int refill_pending;
+};
+
+struct Bucket {
+  uint64_t key;   // hash of the address or subnet, 0 for an unused way
+  uint64_t state; // tokens in RL_UNITs << 32 | coarse_ms() of the last refill
+};
+
+struct BucketSet {
+  alignas(64) struct Bucket way[RL_WAYS];
+};
+
+struct RateLimit {
+  uint32_t rate;  // tokens per second, 0 = no limit
+  uint32_t burst; // bucket size in tokens
+};
+
+/* The settings a running server can change: the command line's, with a
+   --config file on top that is read again on SIGHUP. A reload publishes a
+   new copy and workers switch to it between batches, so each one sees a
+   whole configuration, old or new. Copies stay allocated until exit. */
+struct Config {
+  uint32_t timeout_ms;     // how long a session has to answer
+  uint32_t sessions;       // admitted at once, at most the table's size
+  struct RateLimit source; // -r
+  struct RateLimit subnet; // -R
+  uint32_t queue_delay_ms; // -q, 0 when off
+  uint32_t retry_after_ms; // -a, 0 when off
+  struct Config *prev;     // the copy this one replaced
+};
+
+/* The first page of a --state-file. A file is only attached if every
+   field up to the clocks matches what this server would create. Within
+   one boot (same boot_id) CLOCK_MONOTONIC carries on and the slots'
+   assigned_at are used as they are. After a reboot the clock pair, which
+   ties the monotonic clock to wall time, moves them onto the new clock;
+   with more than one thread they are dropped instead, as the kernel's
+   SO_REUSEPORT hash is seeded anew and sends clients to other shards. */
+struct StateHeader {
+  char magic[8]; // STATE_MAGIC, no terminator
+  uint32_t version;
+  uint32_t job_size; // sizeof(struct Job)
+  uint32_t threads;
+  uint32_t per_shard;
+  uint64_t shard_size;
+  uint64_t mono_ms; // one instant on CLOCK_MONOTONIC
+  uint64_t real_ms; // and on CLOCK_REALTIME
+  char boot_id[40]; // /proc/sys/kernel/random/boot_id of that run
+  uint64_t cookie_key[2]; // -S cookies outlive a restart as well
+};
+static_assert(sizeof(struct StateHeader) <= STATE_HEADER,
+              "state header does not fit its page");
+
+/* A session request parked until a slot frees up (-q). */
+struct Waiter {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint32_t hash; // addr_hash(addr)
+  int sock;
+  int text;            // came in as type 21: the task goes out as text
+  uint32_t ntasks;     // batch size, 0 for a single task
+  uint64_t since_ms;    // now_ms() when parked; -q from then on it's late
+};
+
+/* Per-worker counters. Only the owning worker writes them, so updates are
+   plain relaxed stores; a stats query on any worker sums every shard. */
+struct Stats {
+  uint64_t packets_in;
+  uint64_t packets_out;
+  uint64_t assigned;
+  uint64_t ok;
+  uint64_t failed;
+  uint64_t expired;
+  uint64_t rejected;
+  uint64_t active;
+  uint64_t handle_ns[CALC_STATS_HIST];
+};
+
+#define STAT_ADD(w, field, n)                                                  \
+  __atomic_store_n(&(w)->stats.field, (w)->stats.field + (n), __ATOMIC_RELAXED)
+
+/* One shard of the server: a worker thread with its own SO_REUSEPORT
+   sockets, job table, timer wheel and ID space. Nothing in here is
+   shared, so the packet path takes no locks. */
+struct Worker {
+  int index;
+  pthread_t thread;
+  int socks[MAX_SOCKS];
+  int nsocks;
+  int lsocks[MAX_SOCKS]; // TCP listeners, same addresses as socks
+  int nlsocks;
+  int efd; // eventfd main() writes WAKE_STOP or WAKE_CONFIG to
+  int ep;  // worker_main's epoll instance
+
+  struct Conn *conns; // CONN_MAX slots
+  struct Conn *reply_conn; // set while handling a TCP frame: replies go there
+  int reply_text;          // set while handling a text message: text replies
+
+  /* capacity slots carved out of the shared session arena, of which
+     limit may be in use under the current configuration cfg. */
+  struct Job *jobs;
+  int capacity;
+  int limit;
+  const struct Config *cfg; // stored with release for main() to read
+  /* The last configuration published that the worker couldn't switch to;
+     config_sync() tries it again on every wakeup. */
+  const struct Config *config_failed;
+
+  /* Address-keyed index over jobs[]: bucket heads chain through Job.next.
+     Free slots are kept on an intrusive list through the same field. */
+  int *job_bucket;
+  uint32_t bucket_mask; // bucket count - 1, a power of two >= 2 * capacity
+  int free_head;
+
+  int wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+  uint64_t wheel_used[WHEEL_SLOTS / 64]; // non-empty level 0 slots
+  uint64_t wheel_tick; // every tick before this one has fired
+  int wheel_count;
+
+  struct PacketBatch rx, tx;
+
+  uint32_t next_id; // IDs are index+1 modulo id_stride, unique per shard
+  uint32_t id_stride;
+
+  /* io_uring backend (-B uring); ring.fd is -1 on the epoll backend. */
+  struct Uring ring;
+  struct UringBufs rbufs;
+  struct msghdr ur_msg; // template for the multishot receives
+  int ur_sends;         // SENDMSGs submitted, completion not yet seen
+
+  /* -q: parked session requests, a ring of WAIT_MAX, and their ring
+     positions + 1 by addr_hash (0 for an empty slot); NULL when off. */
+  struct Waiter *waitq;
+  uint16_t *wait_index;
+  uint32_t wait_head;
+  uint32_t wait_count;
+
+  char *cap_buf; // --capture: records not yet written out
+  size_t cap_len;
+  uint64_t cap_flushed_ms;
+
+  calcCtx rng; // inline generation when the pool runs dry
+  struct TaskPool pool;
+
+  alignas(64) struct Stats stats;
+};
+
+/* Every worker, for stats queries; written once before threads start. */
+static struct Worker **all_workers;
+static int worker_count;
+static uint64_t started_ms;
+
+/* -S: binary tasks carry a signed cookie instead of holding a job slot. */
+static int stateless;
+static uint64_t cookie_key[2]; // random per run, or per --state-file
+
+/* The command line's settings, and the configuration workers follow: the
+   same until a --config file is loaded. */
+static struct Config boot_config = {JOB_TIMEOUT_MS, MAX_SESSIONS_LIMIT,
+                                    {0, 0}, {0, 0}, 0, 0, NULL};
+static struct Config *config = &boot_config;
+
+/* -r / -R buckets. SO_REUSEPORT spreads one address's ports over every
+   worker, so they all take from the same tables. Allocated before the
+   first configuration that turns the limit on is published, and kept to
+   the end. */
+static struct BucketSet *rl_source;
+static struct BucketSet *rl_subnet;
+
+/* --state-file: state_attached is set while workers are created from a
+   file an earlier run left, state_rebase_ms is the shift from its clock to
+   ours. */
+static int state_attached;
+static int64_t state_rebase_ms;
+
+/* --capture: every worker appends its records to one file. */
+static int capture_fd = -1;
+static uint64_t capture_t0; // now_ns() when the capture started
+
+/* The generator thread sleeps on refill_cond until a worker asks for more. */
+static pthread_mutex_t refill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refill_cond = PTHREAD_COND_INITIALIZER;
+#ifndef SERVER_SIM
+static int generator_stop;
+#endif
+
+static int udp_send(struct Worker *, struct PacketBatch *tx) {
+  int done = 0;
+  while (done < tx->count) {
+    int n = sendmmsg(tx->sock, tx->msgs + done, tx->count - done, 0);
+    if (n <= 0)
+      break; // same as a lost sendto(): the client will retry
+    done += n;
+  }
+  return done;
+}
+
+static int udp_recv(struct Worker *, int sock, struct PacketBatch *rx) {
+  for (int i = 0; i < rx->cap; i++)
+    rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->addrs[i]);
+  int n = recvmmsg(sock, rx->msgs, rx->cap, MSG_DONTWAIT, NULL);
+  return n > 0 ? n : 0;
+}
+
+static uint64_t udp_clock_ns(int coarse) {
+  struct timespec ts;
+  clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const struct Transport udp_transport = {udp_send, udp_recv,
+                                               udp_clock_ns};
+static const struct Transport *transport = &udp_transport;
+
+static uint64_t now_ns(void) { return transport->clock_ns(0); }
+
+static uint64_t now_ms(void) { return transport->clock_ns(0) / 1000000; }
+
+/* now_ms() to within a scheduler tick, for a fraction of the cost. */
+static uint64_t coarse_ms(void) { return transport->clock_ns(1) / 1000000; }
+
+static void record_handle_time(struct Worker *w, uint64_t ns) {
+  int b = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (b >= CALC_STATS_HIST)
+    b = CALC_STATS_HIST - 1;
+  STAT_ADD(w, handle_ns[b], 1);
+}
+
+static int addr_equal(const struct sockaddr_storage *a, socklen_t alen,
+                      const struct sockaddr_storage *b, socklen_t blen) {
+  if (a->ss_family != b->ss_family)
+    return 0;
+  if (a->ss_family == AF_INET) {
+    const struct sockaddr_in *ai = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *bi = (const struct sockaddr_in *)b;
+    return ai->sin_port == bi->sin_port &&
+           ai->sin_addr.s_addr == bi->sin_addr.s_addr;
+  } else if (a->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *ai6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *bi6 = (const struct sockaddr_in6 *)b;
+    return ai6->sin6_port == bi6->sin6_port &&
+           memcmp(&ai6->sin6_addr, &bi6->sin6_addr, sizeof(ai6->sin6_addr)) ==
+               0;
+  }
+  return 0;
+}
+
+static uint32_t addr_hash(const struct sockaddr_storage *a) {
+  const unsigned char *p;
+  size_t n;
+  uint32_t h = 2166136261u; // FNV-1a
+  if (a->ss_family == AF_INET) {
+    const struct sockaddr_in *ai = (const struct sockaddr_in *)a;
+    p = (const unsigned char *)&ai->sin_addr;
+    n = sizeof(ai->sin_addr);
+    h = (h ^ ai->sin_port) * 16777619u;
+  } else if (a->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *ai6 = (const struct sockaddr_in6 *)a;
+    p = (const unsigned char *)&ai6->sin6_addr;
+    n = sizeof(ai6->sin6_addr);
+    h = (h ^ ai6->sin6_port) * 16777619u;
+  } else
+    return 0;
+  h = (h ^ a->ss_family) * 16777619u;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+/* Bucket key for addr, or for its subnet. IPv4-mapped IPv6 addresses count
+   as IPv4. */
+static uint64_t rl_key(const struct sockaddr_storage *a, int subnet) {
+  const unsigned char *p;
+  int bits;
+  uint64_t h = 14695981039346656037ull; // FNV-1a
+  if (a->ss_family == AF_INET) {
+    p = (const unsigned char *)&((const struct sockaddr_in *)a)->sin_addr;
+    bits = subnet ? RL_V4_PREFIX : 32;
+  } else if (a->ss_family == AF_INET6) {
+    const struct in6_addr *in6 = &((const struct sockaddr_in6 *)a)->sin6_addr;
+    p = (const unsigned char *)in6;
+    bits = subnet ? RL_V6_PREFIX : 128;
+    if (IN6_IS_ADDR_V4MAPPED(in6)) {
+      p += 12;
+      bits = subnet ? RL_V4_PREFIX : 32;
+    }
+  } else
+    return 1;
+  h = (h ^ (uint64_t)bits) * 1099511628211ull;
+  for (int i = 0; i < bits / 8; i++)
+    h = (h ^ p[i]) * 1099511628211ull;
+  if (bits % 8)
+    h = (h ^ (p[bits / 8] & (0xff00 >> (bits % 8)))) * 1099511628211ull;
+  return h ? h : 1;
+}
+
+/* Milliseconds from last to now. Another worker may have read the clock
+   later and refilled first, leaving last a moment ahead: that counts as
+   no time at all. */
+static uint32_t rl_idle(uint32_t now, uint32_t last) {
+  uint32_t idle = now - last;
+  return UINT32_MAX - idle < 1000 ? 0 : idle;
+}
+
+/* Takes a token from key's bucket in table t, refilled for the time since
+   its last use; 0 if there is none. A key not in its set replaces the way
+   idle longest, starting with a full bucket. Workers share t: a bucket's
+   tokens and refill time change together by compare-and-swap. A taker
+   that matched a key just as another worker replaced it charges the
+   newcomer one token, which a table that forgets idle keys can live
+   with. */
+static int rl_take(struct BucketSet *t, uint64_t key,
+                   const struct RateLimit *l, uint32_t now) {
+  struct BucketSet *set = &t[(key >> 32) & (RL_SETS - 1)];
+  uint64_t cap = (uint64_t)l->burst * RL_UNIT;
+  struct Bucket *b = NULL;
+  while (!b) {
+    struct Bucket *victim = &set->way[0];
+    uint64_t victim_key = __atomic_load_n(&victim->key, __ATOMIC_RELAXED);
+    uint32_t victim_idle = 0;
+    for (int i = 0; i < RL_WAYS; i++) {
+      struct Bucket *e = &set->way[i];
+      uint64_t k = __atomic_load_n(&e->key, __ATOMIC_RELAXED);
+      if (k == key) {
+        b = e;
+        break;
+      }
+      uint32_t idle = rl_idle(
+          now, (uint32_t)__atomic_load_n(&e->state, __ATOMIC_RELAXED));
+      if (i == 0 || (victim_key && (!k || idle > victim_idle))) {
+        victim = e;
+        victim_key = k;
+        victim_idle = idle;
+      }
+    }
+    if (!b && __atomic_compare_exchange_n(&victim->key, &victim_key, key, 0,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED)) {
+      __atomic_store_n(&victim->state, (cap - RL_UNIT) << 32 | now,
+                       __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  uint64_t state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+  for (;;) {
+    uint64_t tokens = state >> 32;
+    uint32_t last = (uint32_t)state, idle = rl_idle(now, last);
+    if (idle) {
+      tokens += (uint64_t)idle * l->rate;
+      last = now;
+    }
+    if (tokens > cap)
+      tokens = cap;
+    if (tokens < RL_UNIT)
+      return 0;
+    if (__atomic_compare_exchange_n(&b->state, &state,
+                                    (tokens - RL_UNIT) << 32 | last, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+}
+
+/* Whether addr may start another session. Checked before a slot is
+   claimed or a task made, so a request over the limit costs a hash and a
+   cache line or two. */
+static int admit(struct Worker *w, const struct sockaddr_storage *addr) {
+  const struct Config *c = w->cfg;
+  if (!c->source.rate && !c->subnet.rate)
+    return 1;
+  uint32_t now = (uint32_t)coarse_ms();
+  if ((c->source.rate &&
+       !rl_take(rl_source, rl_key(addr, 0), &c->source, now)) ||
+      (c->subnet.rate &&
+       !rl_take(rl_subnet, rl_key(addr, 1), &c->subnet, now))) {
+    STAT_ADD(w, rejected, 1);
+    return 0;
+  }
+  return 1;
+}
+
+#ifndef SERVER_SIM // sim runs without rate limits
+static struct BucketSet *rl_table_new(void) {
+  struct BucketSet *t = (struct BucketSet *)aligned_alloc(
+      alignof(struct BucketSet), RL_SETS * sizeof(struct BucketSet));
+  if (t)
+    memset(t, 0, RL_SETS * sizeof(struct BucketSet));
+  return t;
+}
+#endif
+
+static void wheel_insert(struct Worker *w, int i, uint64_t tick) {
+  if (tick < w->wheel_tick)
+    tick = w->wheel_tick;
+  uint64_t delta = tick - w->wheel_tick;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+    level++;
+  if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+    tick = w->wheel_tick + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  int slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  int ws = level * WHEEL_SLOTS + slot;
+
+  w->jobs[i].wslot = ws;
+  w->jobs[i].tprev = -1;
+  w->jobs[i].tnext = w->wheel[ws];
+  if (w->wheel[ws] >= 0)
+    w->jobs[w->wheel[ws]].tprev = i;
+  w->wheel[ws] = i;
+  if (level == 0)
+    w->wheel_used[slot >> 6] |= (uint64_t)1 << (slot & 63);
+  w->wheel_count++;
+}
+
+static void wheel_remove(struct Worker *w, int i) {
+  int ws = w->jobs[i].wslot;
+  if (w->jobs[i].tprev >= 0)
+    w->jobs[w->jobs[i].tprev].tnext = w->jobs[i].tnext;
+  else
+    w->wheel[ws] = w->jobs[i].tnext;
+  if (w->jobs[i].tnext >= 0)
+    w->jobs[w->jobs[i].tnext].tprev = w->jobs[i].tprev;
+  if (ws < WHEEL_SLOTS && w->wheel[ws] < 0)
+    w->wheel_used[ws >> 6] &= ~((uint64_t)1 << (ws & 63));
+  w->wheel_count--;
+}
+
+static uint64_t job_expiry_tick(const struct Worker *w, int i) {
+  return (w->jobs[i].assigned_at + w->cfg->timeout_ms + WHEEL_TICK_MS - 1) /
+         WHEEL_TICK_MS;
+}
+
+/* Moves every job of a higher-level slot down to where it now belongs. */
+static void wheel_cascade(struct Worker *w, int level) {
+  int ws = level * WHEEL_SLOTS +
+           ((w->wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+  int i = w->wheel[ws];
+  w->wheel[ws] = -1;
+  while (i >= 0) {
+    int nx = w->jobs[i].tnext;
+    w->wheel_count--;
+    wheel_insert(w, i, job_expiry_tick(w, i));
+    i = nx;
+  }
+}
+
+/* Ticks until the next non-empty level 0 slot, or to the next cascade. */
+static uint64_t wheel_next_delta(const struct Worker *w) {
+  int cur = w->wheel_tick & (WHEEL_SLOTS - 1);
+  for (int b = cur >> 6; b < WHEEL_SLOTS / 64; b++) {
+    uint64_t bits = w->wheel_used[b];
+    if (b == cur >> 6)
+      bits &= ~(uint64_t)0 << (cur & 63);
+    if (bits)
+      return (uint64_t)(b * 64 + __builtin_ctzll(bits) - cur);
+  }
+  return (uint64_t)(WHEEL_SLOTS - cur);
+}
+
+/* Absolute monotonic ms at which the wheel next needs attention, 0 if idle. */
+static uint64_t wheel_deadline_ms(const struct Worker *w) {
+  if (w->wheel_count == 0)
+    return 0;
+  return (w->wheel_tick + wheel_next_delta(w)) * WHEEL_TICK_MS;
+}
+
+/* A TCP client can have many jobs in flight, so its jobs hash by address
+   and id together. */
+static uint32_t job_hash(const struct sockaddr_storage *addr, uint32_t id,
+                         int tcp) {
+  uint32_t h = addr_hash(addr);
+  return tcp ? h ^ (id * 0x9e3779b1u) : h;
+}
+
+static int find_job_addr(struct Worker *w, const struct sockaddr_storage *addr,
+                         socklen_t len) {
+  uint32_t h = addr_hash(addr);
+  for (int i = w->job_bucket[h & w->bucket_mask]; i >= 0;
+       i = w->jobs[i].next)
+    if (w->jobs[i].hash == h && !w->jobs[i].tcp &&
+        addr_equal(&w->jobs[i].addr, w->jobs[i].addr_len, addr, len))
+      return i;
+  return -1;
+}
+
+static int find_job_tcp(struct Worker *w, const struct sockaddr_storage *addr,
+                        socklen_t len, uint32_t id) {
+  uint32_t h = job_hash(addr, id, 1);
+  for (int i = w->job_bucket[h & w->bucket_mask]; i >= 0;
+       i = w->jobs[i].next)
+    if (w->jobs[i].hash == h && w->jobs[i].tcp && w->jobs[i].id == id &&
+        addr_equal(&w->jobs[i].addr, w->jobs[i].addr_len, addr, len))
+      return i;
+  return -1;
+}
+
+static int alloc_job(struct Worker *w) {
+  int i = w->free_head;
+  if (i >= 0)
+    w->free_head = w->jobs[i].next;
+  return i;
+}
+
+/* Links an allocated slot into the index; addr and hash must be set. */
+static void index_job(struct Worker *w, int i) {
+  int *head = &w->job_bucket[w->jobs[i].hash & w->bucket_mask];
+  w->jobs[i].next = *head;
+  *head = i;
+  w->jobs[i].active = 1;
+  STAT_ADD(w, active, 1);
+}
+
+static void release_job(struct Worker *w, int i) {
+  int *pp = &w->job_bucket[w->jobs[i].hash & w->bucket_mask];
+  while (*pp != i)
+    pp = &w->jobs[*pp].next;
+  *pp = w->jobs[i].next;
+  wheel_remove(w, i);
+  w->jobs[i].active = 0;
+  w->jobs[i].next = w->free_head;
+  w->free_head = i;
+  STAT_ADD(w, active, -1);
+}
+
+/* Sets up the shard's free list, index and wheel. A fresh table starts
+   empty. One attached from a --state-file keeps the slots that are still
+   active; their links are rebuilt rather than trusted, their assigned_at
+   is moved onto this run's clock, and jobs that expired in the meantime
+   or belonged to a TCP connection are dropped. */
+static void init_jobs(struct Worker *w) {
+  if (!state_attached)
+    memset(w->jobs, 0, (size_t)w->capacity * sizeof(struct Job));
+  for (uint32_t i = 0; i <= w->bucket_mask; i++)
+    w->job_bucket[i] = -1;
+  for (int i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+    w->wheel[i] = -1;
+  memset(w->wheel_used, 0, sizeof(w->wheel_used));
+  uint64_t now = now_ms();
+  w->wheel_tick = now / WHEEL_TICK_MS;
+  w->wheel_count = 0;
+  w->free_head = -1;
+  uint32_t last_id = 0;
+  for (int i = w->capacity - 1; i >= 0; i--) {
+    struct Job *j = &w->jobs[i];
+    if (j->active) {
+      j->active = 0;
+      int64_t at = (int64_t)j->assigned_at + state_rebase_ms;
+      j->assigned_at = at < 0 ? 0 : at > (int64_t)now ? now : (uint64_t)at;
+      if (!j->tcp && now - j->assigned_at < w->cfg->timeout_ms) {
+        index_job(w, i);
+        wheel_insert(w, i, job_expiry_tick(w, i));
+        if (j->id > last_id)
+          last_id = j->id;
+        continue;
+      }
+    }
+    j->next = w->free_head;
+    w->free_head = i;
+  }
+  /* New IDs continue after the kept ones, in this shard's residue class. */
+  if (last_id && last_id + w->id_stride > last_id)
+    w->next_id = last_id + w->id_stride;
+}
+
+/* Fires every wheel tick up to now; empty stretches are skipped using the
+   level 0 occupancy bitmap, so the cost follows the jobs that expire. */
+static void expire_jobs(struct Worker *w) {
+  uint64_t target = now_ms() / WHEEL_TICK_MS;
+  while (w->wheel_tick <= target) {
+    if (w->wheel_count == 0) {
+      w->wheel_tick = target + 1;
+      break;
+    }
+    int slot = w->wheel_tick & (WHEEL_SLOTS - 1);
+    if (slot == 0)
+      for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+        if ((w->wheel_tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) == 0)
+          wheel_cascade(w, level);
+    while (w->wheel[slot] >= 0) {
+      release_job(w, w->wheel[slot]);
+      STAT_ADD(w, expired, 1);
+    }
+
+    uint64_t skip = wheel_next_delta(w);
+    if (skip == 0)
+      skip = 1;
+    if (w->wheel_tick + skip > target + 1)
+      skip = target + 1 - w->wheel_tick;
+    w->wheel_tick += skip;
+  }
+}
+
+static size_t arena_round(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/* Bytes of arena one shard of <capacity> sessions needs: slots + buckets. */
+static size_t shard_bytes(int capacity, uint32_t *bucket_mask) {
+  uint32_t nb = 1;
+  while (nb < 2 * (uint32_t)capacity)
+    nb <<= 1;
+  *bucket_mask = nb - 1;
+  return arena_round((size_t)capacity * sizeof(struct Job)) +
+         arena_round((size_t)nb * sizeof(int));
+}
+
+/* One anonymous mapping holding every shard's session table. MAP_POPULATE
+   plus the writes in init_jobs() fault it all in before traffic starts.
+   Returns NULL on failure; *bytes is updated to the mapped length and
+   *huge reports whether huge pages were used. */
+static void *arena_alloc(size_t *bytes, int want_huge, int *huge) {
+  void *p = MAP_FAILED;
+  *huge = 0;
+  if (want_huge) {
+    size_t hbytes =
+        (*bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    p = mmap(NULL, hbytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (p != MAP_FAILED) {
+      *bytes = hbytes;
+      *huge = 1;
+    }
+  }
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+    if (want_huge)
+      madvise(p, *bytes, MADV_HUGEPAGE); // transparent huge pages, if enabled
+  }
+  return p;
+}
+
+static int batch_init(struct PacketBatch *b, int cap) {
+  b->count = 0;
+  b->cap = cap;
+  b->sock = -1;
+  b->msgs = (struct mmsghdr *)calloc(cap, sizeof(*b->msgs));
+  b->iov = (struct iovec *)calloc(cap, sizeof(*b->iov));
+  b->addrs = (struct sockaddr_storage *)calloc(cap, sizeof(*b->addrs));
+  b->bufs = (char(*)[PKT_MAX])calloc(cap, PKT_MAX);
+  if (!b->msgs || !b->iov || !b->addrs || !b->bufs)
+    return -1;
+  for (int i = 0; i < cap; i++) {
+    b->iov[i].iov_base = b->bufs[i];
+    b->iov[i].iov_len = PKT_MAX;
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+  }
+  return 0;
+}
+
+/* Appends the worker's buffered records. Each write() is a whole buffer and
+   the file is O_APPEND, so workers never split each other's records. */
+static void capture_flush(struct Worker *w) {
+  size_t off = 0;
+  while (off < w->cap_len) {
+    ssize_t n = write(capture_fd, w->cap_buf + off, w->cap_len - off);
+    if (n <= 0) {
+#ifdef DEBUG
+      printf("CAPTURE WRITE FAILED\n");
+#endif
+      break;
+    }
+    off += n;
+  }
+  w->cap_len = 0;
+  w->cap_flushed_ms = now_ms();
+}
+
+static void capture(struct Worker *w, uint8_t dir,
+                    const struct sockaddr_storage *addr, const void *buf,
+                    size_t n) {
+  struct captureRecord r;
+  if (w->cap_len + sizeof(r) + n > CAPTURE_BUF)
+    capture_flush(w);
+  memset(&r, 0, sizeof(r));
+  r.t_ns = now_ns() - capture_t0;
+  r.dir = dir;
+  r.family = addr->ss_family;
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *a = (const struct sockaddr_in *)addr;
+    r.port = a->sin_port;
+    memcpy(r.addr, &a->sin_addr, sizeof(a->sin_addr));
+  } else if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+    r.port = a->sin6_port;
+    memcpy(r.addr, &a->sin6_addr, sizeof(a->sin6_addr));
+  }
+  r.len = n;
+  memcpy(w->cap_buf + w->cap_len, &r, sizeof(r));
+  memcpy(w->cap_buf + w->cap_len + sizeof(r), buf, n);
+  w->cap_len += sizeof(r) + n;
+}
+
+/* io_uring: one SENDMSG per queued reply, all submitted with a single
+   io_uring_enter(). The tx buffers are reused as soon as this returns, so
+   wait for every send to complete. Other completions are left on the CQ for
+   uring_loop(); send completions seen among them are marked UR_DONE. */
+static void uring_flush(struct Worker *w) {
+  for (int i = 0; i < w->tx.count; i++) {
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+    if (!sqe) {
+      uring_enter(&w->ring, 0);
+      sqe = uring_sqe(&w->ring);
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = w->tx.sock;
+    sqe->addr = (uint64_t)(uintptr_t)&w->tx.msgs[i].msg_hdr;
+    sqe->len = 1;
+    sqe->user_data = UR_TAG(UR_SEND, 0);
+    w->ur_sends++;
+  }
+  unsigned seen = 0; // CQEs from the head already looked at
+  while (w->ur_sends > 0) {
+    if (uring_enter(&w->ring, seen + 1) < 0 && errno != EAGAIN &&
+        errno != EBUSY)
+      break;
+    unsigned ready = uring_cq_ready(&w->ring);
+    for (; seen < ready; seen++) {
+      struct io_uring_cqe *cqe = uring_cqe(&w->ring, seen);
+      if (cqe->user_data >> 32 != UR_SEND)
+        continue;
+      cqe->user_data = UR_TAG(UR_DONE, 0);
+      w->ur_sends--;
+      if (cqe->res > 0)
+        STAT_ADD(w, packets_out, 1);
+    }
+  }
+  w->tx.count = 0;
+}
+
+static void flush_replies(struct Worker *w) {
+  if (w->cap_buf)
+    for (int i = 0; i < w->tx.count; i++)
+      capture(w, CAPTURE_OUT, &w->tx.addrs[i], w->tx.bufs[i],
+              w->tx.iov[i].iov_len);
+  if (w->ring.fd >= 0) {
+    uring_flush(w);
+    return;
+  }
+  if (w->tx.count > 0)
+    STAT_ADD(w, packets_out, transport->send(w, &w->tx));
+  w->tx.count = 0;
+}
+
+/* Reserves the next outgoing datagram of <size> bytes to addr and returns
+   its buffer; queued replies leave in one sendmmsg() at flush time. */
+static char *tx_reserve(struct Worker *w, int sock,
+                        const struct sockaddr_storage *addr, socklen_t len,
+                        size_t size) {
+  if (w->reply_conn) {
+    /* conn_service() made sure a full frame fits. */
+    struct Conn *c = w->reply_conn;
+    char *f = c->out + c->out_len;
+    STAT_ADD(w, packets_out, 1);
+    if (c->text) {
+      c->out_len += size;
+      return f;
+    }
+    f[0] = size >> 8;
+    f[1] = size & 0xff;
+    c->out_len += FRAME_HDR + size;
+    return f + FRAME_HDR;
+  }
+  if (w->tx.count == w->tx.cap || (w->tx.count > 0 && w->tx.sock != sock))
+    flush_replies(w);
+  w->tx.sock = sock;
+  int i = w->tx.count++;
+  memcpy(&w->tx.addrs[i], addr, len);
+  w->tx.msgs[i].msg_hdr.msg_namelen = len;
+  w->tx.iov[i].iov_len = size;
+  return w->tx.bufs[i];
+}
+
+/* Every calcMessage the server sends, in wire order:
+   [type 1 or 2][message 1 (OK) or 2 (NOT OK)][UDP, TCP]. */
+static constexpr struct calcMessage calc_msg_images[2][2][2] = {
+    {{calc_msg_image(1, 1, 17, 0), calc_msg_image(1, 1, 6, 0)},
+     {calc_msg_image(1, 2, 17, 0), calc_msg_image(1, 2, 6, 0)}},
+    {{calc_msg_image(2, 1, 17, 0), calc_msg_image(2, 1, 6, 0)},
+     {calc_msg_image(2, 2, 17, 0), calc_msg_image(2, 2, 6, 0)}}};
+
+static void send_calc_msg(struct Worker *w, int sock,
+                          const struct sockaddr_storage *addr, socklen_t len,
+                          uint16_t type, uint32_t message) {
+  if (w->reply_text) {
+    const char *line = message == 1 ? "OK\n" : "NOT OK\n";
+    memcpy(tx_reserve(w, sock, addr, len, strlen(line)), line, strlen(line));
+    return;
+  }
+  const struct calcMessage *m =
+      &calc_msg_images[type - 1][message - 1][w->reply_conn != NULL];
+  memcpy(tx_reserve(w, sock, addr, len, sizeof(*m)), m, sizeof(*m));
+}
+
+/* Builds n finished tasks: wire image plus expected result. Operators and
+   operands come from calcLib in bulk, one call per array, and the expected
+   results from one calc_solve() over all of them. */
+static void generate_tasks(calcCtx *rng, struct PooledTask *out, int n) {
+  uint32_t ariths[POOL_CHUNK];
+  int i1[POOL_CHUNK], i2[POOL_CHUNK];
+  double f1[POOL_CHUNK], f2[POOL_CHUNK];
+  int32_t iexp[POOL_CHUNK];
+  double fexp[POOL_CHUNK];
+  calc_ctx_fill_ariths(rng, ariths, n);
+  calc_ctx_fill_ints(rng, i1, n);
+  calc_ctx_fill_ints(rng, i2, n);
+  calc_ctx_fill_floats(rng, f1, n);
+  calc_ctx_fill_floats(rng, f2, n);
+  calc_solve(ariths, i1, i2, f1, f2, iexp, fexp, n);
+
+  for (int i = 0; i < n; i++) {
+    struct PooledTask *pt = &out[i];
+    pt->arith = ariths[i];
+    pt->iexp = iexp[i];
+    pt->fexp = fexp[i];
+
+    struct calcProtocol t;
+    memset(&t, 0, sizeof(t));
+    t.type = 1;
+    t.major_version = 1;
+    t.arith = ariths[i];
+    if (ariths[i] <= 4) {
+      t.inValue1 = i1[i];
+      t.inValue2 = i2[i];
+    } else {
+      t.flValue1 = f1[i];
+      t.flValue2 = f2[i];
+    }
+    wire_encode(&pt->wire, &t);
+  }
+}
+
+/* Tops a pool up to POOL_SIZE; runs on the generator thread. */
+static void pool_refill(struct TaskPool *tp) {
+  uint64_t tail = tp->tail;
+  for (;;) {
+    uint64_t head = __atomic_load_n(&tp->head, __ATOMIC_ACQUIRE);
+    int room = POOL_SIZE - (int)(tail - head);
+    if (room <= 0)
+      break;
+    int pos = tail & (POOL_SIZE - 1);
+    int n = room < POOL_CHUNK ? room : POOL_CHUNK;
+    if (n > POOL_SIZE - pos)
+      n = POOL_SIZE - pos; // don't run past the end of the ring
+    generate_tasks(&tp->rng, &tp->ring[pos], n);
+    tail += n;
+    __atomic_store_n(&tp->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+#ifndef SERVER_SIM // sim refills the pools itself, on its one thread
+static void *generator_main(void *arg) {
+  struct Worker **workers = (struct Worker **)arg;
+  pthread_mutex_lock(&refill_lock);
+  while (!generator_stop) {
+    /* Only sleep after a full pass under the lock found nothing to do, so
+       a request made while we were refilling another pool is not lost. */
+    int busy = 0;
+    for (int t = 0; workers[t]; t++) {
+      struct TaskPool *tp = &workers[t]->pool;
+      if (__atomic_load_n(&tp->refill_pending, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&refill_lock);
+        pool_refill(tp);
+        __atomic_store_n(&tp->refill_pending, 0, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&refill_lock);
+        busy = 1;
+      }
+    }
+    if (!busy)
+      pthread_cond_wait(&refill_cond, &refill_lock);
+  }
+  pthread_mutex_unlock(&refill_lock);
+  return NULL;
+}
+#endif
+
+/* Takes the next ready task into scratch, falling back to generating one
+   inline if the generator has not kept up. */
+static const struct PooledTask *pool_pop(struct Worker *w,
+                                         struct PooledTask *scratch) {
+  struct TaskPool *tp = &w->pool;
+  uint64_t head = tp->head;
+  uint64_t avail = __atomic_load_n(&tp->tail, __ATOMIC_ACQUIRE) - head;
+  if (avail <= POOL_LOW_WATER &&
+      !__atomic_load_n(&tp->refill_pending, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&tp->refill_pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&refill_lock);
+    pthread_cond_signal(&refill_cond);
+    pthread_mutex_unlock(&refill_lock);
+  }
+  if (avail == 0) {
+    generate_tasks(&w->rng, scratch, 1);
+    return scratch;
+  }
+  /* Copy out before releasing the slot: the generator may refill it as
+     soon as head moves past it. */
+  *scratch = tp->ring[head & (POOL_SIZE - 1)];
+  __atomic_store_n(&tp->head, head + 1, __ATOMIC_RELEASE);
+  return scratch;
+}
+
+/* NOT OK to a session request that gets no slot; with -a a binary reply
+   says when to try again. */
+static void send_busy(struct Worker *w, int sock,
+                      const struct sockaddr_storage *addr, socklen_t len) {
+  STAT_ADD(w, rejected, 1);
+  uint32_t retry_after_ms = w->cfg->retry_after_ms;
+  if (!retry_after_ms || w->reply_text) {
+    send_calc_msg(w, sock, addr, len, 2, 2);
+    return;
+  }
+  struct calcMessage m;
+  m.type = 2;
+  m.message = 2 | retry_after_ms << 16;
+  m.protocol = w->reply_conn ? 6 : 17;
+  m.major_version = 1;
+  m.minor_version = 0;
+  wire_encode(tx_reserve(w, sock, addr, len, sizeof(m)), &m);
+}
+
+/* The wait_index slot holding addr's place in the queue, or the empty
+   slot where it would go. The index is never more than half full. */
+static uint32_t wait_find(const struct Worker *w, uint32_t h,
+                          const struct sockaddr_storage *addr,
+                          socklen_t len) {
+  for (uint32_t s = h & (WAIT_INDEX - 1);; s = (s + 1) & (WAIT_INDEX - 1)) {
+    uint16_t e = w->wait_index[s];
+    if (e == 0)
+      return s;
+    const struct Waiter *q = &w->waitq[e - 1];
+    if (q->hash == h && addr_equal(&q->addr, q->addr_len, addr, len))
+      return s;
+  }
+}
+
+/* Parks a UDP request for a task (ntasks 0) or a batch until a slot frees
+   up. Returns 0 if it can't wait: -q is off, the queue is full, or the
+   request came over TCP, whose replies must stay in order. A client that
+   asks again while it waits keeps its place and is answered once. */
+static int wait_push(struct Worker *w, int sock,
+                     const struct sockaddr_storage *addr, socklen_t len,
+                     uint32_t ntasks) {
+  if (!w->cfg->queue_delay_ms || !w->waitq || w->reply_conn || sock < 0)
+    return 0;
+  uint32_t h = addr_hash(addr);
+  uint32_t s = wait_find(w, h, addr, len);
+  if (w->wait_index[s]) {
+    struct Waiter *q = &w->waitq[w->wait_index[s] - 1];
+    q->text = w->reply_text;
+    q->ntasks = ntasks;
+    return 1;
+  }
+  if (w->wait_count == WAIT_MAX)
+    return 0;
+  uint32_t pos = (w->wait_head + w->wait_count++) & (WAIT_MAX - 1);
+  struct Waiter *q = &w->waitq[pos];
+  memcpy(&q->addr, addr, len);
+  q->addr_len = len;
+  q->hash = h;
+  q->sock = sock;
+  q->text = w->reply_text;
+  q->ntasks = ntasks;
+  q->since_ms = now_ms();
+  w->wait_index[s] = (uint16_t)(pos + 1);
+  return 1;
+}
+
+/* Whether the shard has no slot it may hand out: all are taken, or as
+   many as the configuration admits. */
+static int table_full(const struct Worker *w) {
+  return w->free_head < 0 || w->stats.active >= (uint64_t)w->limit;
+}
+
+/* Takes a slot for a new job from addr, replacing any it already has, and
+   hands out the next ID. On a full table the request is queued or turned
+   away, and -1 returned. */
+static int claim_job(struct Worker *w, int sock,
+                     const struct sockaddr_storage *addr, socklen_t len,
+                     uint32_t ntasks, uint32_t *id) {
+  /* A UDP client asking again replaces its outstanding task; over TCP
+     requests are pipelined and each one gets a job of its own. */
+  int slot = w->reply_conn ? -1 : find_job_addr(w, addr, len);
+  if (slot >= 0)
+    release_job(w, slot);
+  slot = table_full(w) ? -1 : alloc_job(w);
+  if (slot < 0) {
+    if (!wait_push(w, sock, addr, len, ntasks))
+      send_busy(w, sock, addr, len);
+    return -1;
+  }
+
+  *id = w->next_id;
+  w->next_id += w->id_stride;
+  if (w->next_id < *id) // wrapped
+    w->next_id = w->index + 1;
+  return slot;
+}
+
+/* Makes a claimed slot live: indexed and on the timer wheel. */
+static void start_job(struct Worker *w, int slot,
+                      const struct sockaddr_storage *addr, socklen_t len,
+                      uint32_t id) {
+  struct Job *j = &w->jobs[slot];
+  memcpy(&j->addr, addr, len);
+  j->addr_len = len;
+  j->tcp = w->reply_conn != NULL;
+  j->hash = job_hash(addr, id, j->tcp);
+  j->id = id;
+  j->assigned_at = now_ms();
+  index_job(w, slot);
+  wheel_insert(w, slot, job_expiry_tick(w, slot));
+  STAT_ADD(w, assigned, 1);
+}
+
+/* Stateless mode. A task's id is its issue time in milliseconds, and a
+   SipHash tag covers the client address, the id, the task's place in its
+   batch (0 of 0 for a single task) and the task itself. The tag goes in
+   the fields the task's type leaves unused: flValue1 for an integer task,
+   inValue1/inValue2 for a double task. Clients echo every field, so a
+   result can be checked from the datagram alone. */
+static uint64_t cookie_tag(const struct sockaddr_storage *addr, int tcp,
+                           uint32_t id, uint32_t index, uint32_t count,
+                           uint32_t arith, int32_t i1, int32_t i2, double f1,
+                           double f2) {
+  unsigned char m[64];
+  size_t n = 0;
+#define PUT(v) (memcpy(m + n, &(v), sizeof(v)), n += sizeof(v))
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *a = (const struct sockaddr_in *)addr;
+    PUT(a->sin_port);
+    PUT(a->sin_addr);
+  } else if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+    PUT(a->sin6_port);
+    PUT(a->sin6_addr);
+  }
+  uint32_t shape = index | count << 16 | (uint32_t)tcp << 31;
+  PUT(shape);
+  PUT(id);
+  PUT(arith);
+  PUT(i1);
+  PUT(i2);
+  PUT(f1);
+  PUT(f2);
+#undef PUT
+  return siphash24(cookie_key, m, n);
+}
+
+/* Turns the host-order task t into a cookie issued now. */
+static void cookie_stamp(struct Worker *w, struct calcProtocol *t,
+                         const struct sockaddr_storage *addr, uint32_t id,
+                         uint32_t index, uint32_t count) {
+  int tcp = w->reply_conn != NULL;
+  t->id = id;
+  if (t->arith <= 4) {
+    uint64_t tag = cookie_tag(addr, tcp, id, index, count, t->arith,
+                              t->inValue1, t->inValue2, 0.0, 0.0);
+    uint64_t bits = COOKIE_ONE | (tag & COOKIE_MANT);
+    double f;
+    memcpy(&f, &bits, sizeof(f));
+    t->flValue1 = f;
+    t->flValue2 = 0.0;
+  } else {
+    uint64_t tag = cookie_tag(addr, tcp, id, index, count, t->arith, 0, 0,
+                              t->flValue1, t->flValue2);
+    t->inValue1 = (uint32_t)tag;
+    t->inValue2 = (uint32_t)(tag >> 32);
+  }
+}
+
+/* Whether the host-order task r is a cookie this server issued to addr
+   within the timeout. */
+static int cookie_valid(struct Worker *w, const struct calcProtocol *r,
+                        const struct sockaddr_storage *addr, uint32_t index,
+                        uint32_t count) {
+  int tcp = w->reply_conn != NULL;
+  uint32_t id = r->id, arith = r->arith;
+  if ((uint32_t)now_ms() - id >= w->cfg->timeout_ms)
+    return 0;
+  if (arith <= 4) {
+    uint64_t tag = cookie_tag(addr, tcp, id, index, count, arith,
+                              r->inValue1, r->inValue2, 0.0, 0.0);
+    double f = r->flValue1;
+    uint64_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits == (COOKIE_ONE | (tag & COOKIE_MANT));
+  }
+  uint64_t tag = cookie_tag(addr, tcp, id, index, count, arith, 0, 0,
+                            r->flValue1, r->flValue2);
+  return (uint32_t)r->inValue1 == (uint32_t)tag &&
+         (uint32_t)r->inValue2 == (uint32_t)(tag >> 32);
+}
+
+static void assign_cookie(struct Worker *w, int sock,
+                          const struct sockaddr_storage *addr,
+                          socklen_t len) {
+  struct PooledTask scratch;
+  const struct PooledTask *pt = pool_pop(w, &scratch);
+  struct calcProtocol t;
+  wire_decode(&t, &pt->wire);
+  cookie_stamp(w, &t, addr, (uint32_t)now_ms(), 0, 0);
+  wire_encode(tx_reserve(w, sock, addr, len, sizeof(t)), &t);
+  STAT_ADD(w, assigned, 1);
+}
+
+static void assign_task(struct Worker *w, int sock,
+                        const struct sockaddr_storage *addr, socklen_t len) {
+  /* Text results only bring back the id, so text tasks keep a job. */
+  if (stateless && !w->reply_text) {
+    assign_cookie(w, sock, addr, len);
+    return;
+  }
+  uint32_t id;
+  int slot = claim_job(w, sock, addr, len, 0, &id);
+  if (slot < 0)
+    return;
+
+  struct PooledTask scratch;
+  const struct PooledTask *pt = pool_pop(w, &scratch);
+  if (w->reply_text) {
+    struct calcProtocol t;
+    wire_decode(&t, &pt->wire);
+    t.id = id;
+    char line[CALC_TEXT_LINE_MAX];
+    size_t n = calc_text_task(line, &t);
+    memcpy(tx_reserve(w, sock, addr, len, n), line, n);
+  } else {
+    struct calcProtocol *p = (struct calcProtocol *)tx_reserve(
+        w, sock, addr, len, sizeof(struct calcProtocol));
+    memcpy(p, &pt->wire, sizeof(*p));
+    p->id = wire_order(id);
+  }
+
+  struct Job *j = &w->jobs[slot];
+  j->arith = pt->arith;
+  j->iexp = pt->iexp;
+  j->fexp = pt->fexp;
+  j->ntasks = 0;
+  start_job(w, slot, addr, len, id);
+}
+
+/* Sends ntasks tasks in one calcBatch datagram. Only a seed is kept per
+   job; the tasks are generated from it again when the results come back,
+   so a batch costs the table no more than a single task. In stateless mode
+   every task carries its own cookie instead. */
+static void assign_batch(struct Worker *w, int sock,
+                         const struct sockaddr_storage *addr, socklen_t len,
+                         uint32_t ntasks) {
+  uint32_t id;
+  int slot = -1;
+  uint64_t seed = calc_ctx_u64(&w->rng);
+  if (stateless) {
+    id = (uint32_t)now_ms();
+  } else {
+    slot = claim_job(w, sock, addr, len, ntasks, &id);
+    if (slot < 0)
+      return;
+    w->jobs[slot].ntasks = ntasks;
+    w->jobs[slot].seed = seed;
+  }
+  struct PooledTask tasks[CALC_BATCH_MAX];
+  calcCtx rng;
+  calc_ctx_init(&rng, seed);
+  generate_tasks(&rng, tasks, ntasks);
+
+  char *out = tx_reserve(w, sock, addr, len,
+                         sizeof(struct calcBatch) +
+                             ntasks * sizeof(struct calcProtocol));
+  struct calcBatch hdr;
+  hdr.type = 1;
+  hdr.major_version = 1;
+  hdr.minor_version = 1;
+  hdr.count = ntasks;
+  hdr.id = id;
+  wire_encode(out, &hdr);
+  out += sizeof(hdr);
+  for (uint32_t i = 0; i < ntasks; i++, out += sizeof(struct calcProtocol)) {
+    struct calcProtocol t;
+    wire_decode(&t, &tasks[i].wire);
+    t.minor_version = 1;
+    if (stateless)
+      cookie_stamp(w, &t, addr, id, i, ntasks);
+    else
+      t.id = id;
+    wire_encode(out, &t);
+  }
+  if (stateless)
+    STAT_ADD(w, assigned, 1);
+  else
+    start_job(w, slot, addr, len, id);
+}
+
+static int is_loopback(const struct sockaddr_storage *a) {
+  if (a->ss_family == AF_INET)
+    return (ntohl(((const struct sockaddr_in *)a)->sin_addr.s_addr) >> 24) ==
+           127;
+  if (a->ss_family == AF_INET6)
+    return IN6_IS_ADDR_LOOPBACK(&((const struct sockaddr_in6 *)a)->sin6_addr);
+  return 0;
+}
+
+/* Sums every shard's counters into a calcStats reply. */
+static void send_stats(struct Worker *w, int sock,
+                       const struct sockaddr_storage *addr, socklen_t len) {
+  struct calcStats st;
+  memset(&st, 0, sizeof(st));
+  uint64_t hist[CALC_STATS_HIST] = {0};
+  uint64_t capacity = 0;
+  for (int t = 0; t < worker_count; t++) {
+    const struct Worker *o = all_workers[t];
+#define SUM(dst, field)                                                        \
+  dst += __atomic_load_n(&o->stats.field, __ATOMIC_RELAXED)
+    SUM(st.packets_in, packets_in);
+    SUM(st.packets_out, packets_out);
+    SUM(st.sessions_assigned, assigned);
+    SUM(st.sessions_ok, ok);
+    SUM(st.sessions_failed, failed);
+    SUM(st.sessions_expired, expired);
+    SUM(st.sessions_rejected, rejected);
+    SUM(st.sessions_active, active);
+    for (int b = 0; b < CALC_STATS_HIST; b++)
+      SUM(hist[b], handle_ns[b]);
+#undef SUM
+    capacity += __atomic_load_n(&o->limit, __ATOMIC_RELAXED);
+  }
+
+  st.type = 3;
+  st.major_version = 1;
+  st.minor_version = 0;
+  st.threads = worker_count;
+  st.uptime_ms = now_ms() - started_ms;
+  st.sessions_capacity = capacity;
+  memcpy(st.handle_ns, hist, sizeof(st.handle_ns));
+  wire_encode(tx_reserve(w, sock, addr, len, sizeof(st)), &st);
+}
+
+/* Looks up the job a result from addr answers. A result for an unknown
+   client, for another ID or of the wrong shape (single task vs batch) gets
+   NOT OK; so does one that comes too late, which also ends the job.
+   Returns the job's slot, or -1 once the verdict has been sent. */
+static int take_job(struct Worker *w, int sock,
+                    const struct sockaddr_storage *addr, socklen_t len,
+                    uint32_t id, uint32_t ntasks) {
+  int idx = w->reply_conn ? find_job_tcp(w, addr, len, id)
+                          : find_job_addr(w, addr, len);
+  if (idx < 0) {
+    send_calc_msg(w, sock, addr, len, 2, 2);
+    return -1;
+  }
+
+  if (now_ms() - w->jobs[idx].assigned_at >= w->cfg->timeout_ms) {
+    release_job(w, idx);
+    STAT_ADD(w, failed, 1);
+    send_calc_msg(w, sock, addr, len, 2, 2);
+    return -1;
+  }
+  if (w->jobs[idx].id != id || w->jobs[idx].ntasks != ntasks) {
+    send_calc_msg(w, sock, addr, len, 2, 2);
+    return -1;
+  }
+  return idx;
+}
+
+/* Results for a task batch: one verdict bit per task, in order. */
+static void check_batch(struct Worker *w, int sock, const char *buf,
+                        ssize_t n, const struct sockaddr_storage *addr,
+                        socklen_t len) {
+  struct calcBatch hdr;
+  wire_decode(&hdr, buf);
+  uint32_t count = ((size_t)n - sizeof(hdr)) / sizeof(struct calcProtocol);
+  if (hdr.type != 2 || hdr.major_version != 1 || hdr.minor_version != 1 ||
+      hdr.count != count || count > CALC_BATCH_MAX) {
+    send_calc_msg(w, sock, addr, len, 2, 2);
+    return;
+  }
+  uint32_t ariths[CALC_BATCH_MAX];
+  int32_t iwant[CALC_BATCH_MAX], igot[CALC_BATCH_MAX];
+  double fwant[CALC_BATCH_MAX], fgot[CALC_BATCH_MAX];
+  uint32_t valid = ((uint32_t)1 << count) - 1;
+  const char *entry = buf + sizeof(hdr);
+  int idx = -1;
+  if (stateless) {
+    /* Expected results straight from the echoed tasks, for the ones whose
+       cookie checks out. */
+    int32_t i1[CALC_BATCH_MAX], i2[CALC_BATCH_MAX];
+    double f1[CALC_BATCH_MAX], f2[CALC_BATCH_MAX];
+    for (uint32_t i = 0; i < count; i++, entry += sizeof(struct calcProtocol)) {
+      struct calcProtocol r;
+      wire_decode(&r, entry);
+      if (r.id != hdr.id || !cookie_valid(w, &r, addr, i, count))
+        valid &= ~((uint32_t)1 << i);
+      ariths[i] = r.arith;
+      i1[i] = r.inValue1;
+      i2[i] = r.inValue2;
+      f1[i] = r.flValue1;
+      f2[i] = r.flValue2;
+      igot[i] = r.inResult;
+      fgot[i] = r.flResult;
+    }
+    calc_solve(ariths, i1, i2, f1, f2, iwant, fwant, count);
+  } else {
+    idx = take_job(w, sock, addr, len, hdr.id, count);
+    if (idx < 0)
+      return;
+
+    struct PooledTask tasks[CALC_BATCH_MAX];
+    calcCtx rng;
+    calc_ctx_init(&rng, w->jobs[idx].seed);
+    generate_tasks(&rng, tasks, count);
+    for (uint32_t i = 0; i < count; i++, entry += sizeof(struct calcProtocol)) {
+      struct calcProtocol r;
+      wire_decode(&r, entry);
+      ariths[i] = tasks[i].arith;
+      iwant[i] = tasks[i].iexp;
+      igot[i] = r.inResult;
+      fwant[i] = tasks[i].fexp;
+      fgot[i] = r.flResult;
+    }
+  }
+  uint32_t bitmap =
+      (uint32_t)calc_check(ariths, iwant, igot, fwant, fgot, count) & valid;
+  int all = bitmap == ((uint32_t)1 << count) - 1;
+
+  struct calcBatchVerdict v;
+  v.type = 2;
+  v.message = all ? 1 : 2;
+  v.protocol = w->reply_conn ? 6 : 17;
+  v.major_version = 1;
+  v.minor_version = 1;
+  v.count = count;
+  v.bitmap = bitmap;
+  wire_encode(tx_reserve(w, sock, addr, len, sizeof(v)), &v);
+  if (idx >= 0)
+    release_job(w, idx);
+  if (all)
+    STAT_ADD(w, ok, 1);
+  else
+    STAT_ADD(w, failed, 1);
+}
+
+/* One text protocol line, without its '\n': "TASK" asks for a task,
+   "<id> <result>" answers one. Replies are text as well. */
+static void handle_text(struct Worker *w, int sock, const char *line,
+                        size_t n, const struct sockaddr_storage *addr,
+                        socklen_t len) {
+  w->reply_text = 1;
+  struct calcTextCursor cur = {line, line + n};
+  const char *tok;
+  size_t tlen;
+  uint32_t id = 0;
+  if (!calc_text_token(&cur, &tok, &tlen)) {
+    send_calc_msg(w, sock, addr, len, 1, 2);
+  } else if (tlen == 4 && memcmp(tok, "TASK", 4) == 0 &&
+             calc_text_done(&cur)) {
+    if (admit(w, addr))
+      assign_task(w, sock, addr, len);
+  } else if (std::from_chars(tok, tok + tlen, id).ptr != tok + tlen) {
+    send_calc_msg(w, sock, addr, len, 1, 2);
+  } else {
+    int idx = take_job(w, sock, addr, len, id, 0);
+    if (idx >= 0) {
+      struct Job *j = &w->jobs[idx];
+      int32_t iv;
+      double fv;
+      int ok;
+      if (j->arith <= 4)
+        ok = calc_text_number(&cur, &iv) && calc_text_done(&cur) &&
+             calc_result_ok(j->arith, j->iexp, iv, 0.0, 0.0);
+      else
+        ok = calc_text_number(&cur, &fv) && calc_text_done(&cur) &&
+             calc_result_ok(j->arith, 0, 0, j->fexp, fv);
+      send_calc_msg(w, sock, addr, len, 1, ok ? 1 : 2);
+      release_job(w, idx);
+      if (ok)
+        STAT_ADD(w, ok, 1);
+      else
+        STAT_ADD(w, failed, 1);
+    }
+  }
+  w->reply_text = 0;
+}
+
+static void handle_packet(struct Worker *w, int sock, const char *buf,
+                          ssize_t n, const struct sockaddr_storage *addr,
+                          socklen_t len) {
+  if (w->cap_buf && sock >= 0)
+    capture(w, CAPTURE_IN, addr, buf, n);
+
+  /* Binary messages start with the high byte of a small type. */
+  if (n > 0 && buf[0] != 0) {
+    size_t line = n;
+    if (buf[line - 1] == '\n')
+      line--;
+    handle_text(w, sock, buf, line, addr, len);
+    return;
+  }
+
+  if ((size_t)n == sizeof(struct calcMessage)) {
+    struct calcMessage m;
+    wire_decode(&m, buf);
+    uint16_t type = m.type, proto = m.protocol;
+    uint16_t maj = m.major_version, min = m.minor_version;
+    uint32_t msg = m.message;
+
+    uint16_t want_proto = w->reply_conn ? 6 : 17;
+
+    /* Session requests pass admission control here, once; a queued one
+       is not charged again when it is served. */
+    if (type == 22 && msg == 0 && proto == want_proto && maj == 1 &&
+        min == 0) {
+      if (admit(w, addr))
+        assign_task(w, sock, addr, len);
+    } else if (type == 21 && msg == 0 && proto == want_proto && maj == 1 &&
+               min == 0) {
+      handle_text(w, sock, "TASK", 4, addr, len);
+    } else if (type == 22 && msg >= 1 && msg <= CALC_BATCH_MAX &&
+               proto == want_proto && maj == 1 && min == 1) {
+      if (admit(w, addr))
+        assign_batch(w, sock, addr, len, msg);
+    } else if (type == 23 && maj == 1 && is_loopback(addr)) {
+      send_stats(w, sock, addr, len);
+    } else {
+      send_calc_msg(w, sock, addr, len, 2, 2);
+    }
+    return;
+  }
+
+  if ((size_t)n == sizeof(struct calcProtocol)) {
+    struct calcProtocol r;
+    wire_decode(&r, buf);
+
+    if (stateless) {
+      int ok = cookie_valid(w, &r, addr, 0, 0) &&
+               calc_result_ok(r.arith,
+                              calc_int(r.arith, r.inValue1, r.inValue2),
+                              r.inResult,
+                              calc_double(r.arith, r.flValue1, r.flValue2),
+                              r.flResult);
+      send_calc_msg(w, sock, addr, len, 2, ok ? 1 : 2);
+      if (ok)
+        STAT_ADD(w, ok, 1);
+      else
+        STAT_ADD(w, failed, 1);
+      return;
+    }
 
-static void sigint_handler(int signum) {
-  (void)signum;
-  terminate_flag = 1;
-}
-static void sigalrm_handler(int signum) {
-  (void)signum;
-  housekeeping_flag = 1;
+    int idx = take_job(w, sock, addr, len, r.id, 0);
+    if (idx < 0)
+      return;
+
+    struct Job *j = &w->jobs[idx];
+    int ok = calc_result_ok(j->arith, j->iexp, r.inResult, j->fexp,
+                            r.flResult);
+
+    send_calc_msg(w, sock, addr, len, 2, ok ? 1 : 2);
+    release_job(w, idx);
+    if (ok)
+      STAT_ADD(w, ok, 1);
+    else
+      STAT_ADD(w, failed, 1);
+    return;
+  }
+
+  if ((size_t)n > sizeof(struct calcBatch) &&
+      ((size_t)n - sizeof(struct calcBatch)) % sizeof(struct calcProtocol) ==
+          0) {
+    check_batch(w, sock, buf, n, addr, len);
+    return;
+  }
+
+  send_calc_msg(w, sock, addr, len, 2, 2);
 }
 
-static int addr_equal(const struct sockaddr_storage *a, socklen_t alen,
-                      const struct sockaddr_storage *b, socklen_t blen) {
-  if (a->ss_family != b->ss_family)
-    return 0;
-  if (a->ss_family == AF_INET) {
-    const struct sockaddr_in *ai = (const struct sockaddr_in *)a;
-    const struct sockaddr_in *bi = (const struct sockaddr_in *)b;
-    return ai->sin_port == bi->sin_port &&
-           ai->sin_addr.s_addr == bi->sin_addr.s_addr;
-  } else if (a->ss_family == AF_INET6) {
-    const struct sockaddr_in6 *ai6 = (const struct sockaddr_in6 *)a;
-    const struct sockaddr_in6 *bi6 = (const struct sockaddr_in6 *)b;
-    return ai6->sin6_port == bi6->sin6_port &&
-           memcmp(&ai6->sin6_addr, &bi6->sin6_addr, sizeof(ai6->sin6_addr)) ==
-               0;
+/* Puts w under configuration c: its share of c->sessions and the wait
+   queue c needs (the rate limit tables are main()'s, see
+   rl_tables_alloc()). A wait queue stays once made, for the requests
+   already in it. On failure w keeps its configuration and -1 is
+   returned. */
+static int worker_configure(struct Worker *w, const struct Config *c) {
+  if (c->queue_delay_ms && !w->waitq) {
+    struct Waiter *waitq = (struct Waiter *)calloc(WAIT_MAX, sizeof(*waitq));
+    uint16_t *index = (uint16_t *)calloc(WAIT_INDEX, sizeof(*index));
+    if (!waitq || !index) {
+      free(waitq);
+      free(index);
+      return -1;
+    }
+    w->waitq = waitq;
+    w->wait_index = index;
   }
+  __atomic_store_n(&w->cfg, c, __ATOMIC_RELEASE);
+  /* id_stride is the thread count. */
+  uint32_t share = (c->sessions + w->id_stride - 1) / w->id_stride;
+  __atomic_store_n(&w->limit,
+                   share < (uint32_t)w->capacity ? (int)share : w->capacity,
+                   __ATOMIC_RELAXED);
   return 0;
 }
 
-static int find_job_addr(const struct sockaddr_storage *addr, socklen_t len) {
-  for (int i = 0; i < MAX_JOBS; i++)
-    if (jobs[i].active &&
-        addr_equal(&jobs[i].addr, jobs[i].addr_len, addr, len))
-      return i;
-  return -1;
+/* Sets up shard t of nthreads over shard_mem (shard_bytes() of arena) with
+   an empty table and a full task pool. Sockets are the caller's business. */
+static struct Worker *worker_create(int t, int nthreads, int capacity,
+                                    uint32_t bucket_mask, char *shard_mem,
+                                    int batch, uint64_t seed) {
+  struct Worker *w =
+      (struct Worker *)aligned_alloc(alignof(struct Worker), sizeof(*w));
+  if (!w)
+    return NULL;
+  memset(w, 0, sizeof(*w));
+  w->efd = -1;
+  w->ep = -1;
+  w->ring.fd = -1;
+  w->conns = (struct Conn *)calloc(CONN_MAX, sizeof(struct Conn));
+  if (!w->conns)
+    return NULL;
+  for (int i = 0; i < CONN_MAX; i++)
+    w->conns[i].fd = -1;
+  if (batch_init(&w->rx, batch) < 0 || batch_init(&w->tx, batch) < 0)
+    return NULL;
+  w->index = t;
+  w->next_id = t + 1;
+  w->id_stride = nthreads;
+  calc_ctx_init(&w->rng, seed + t);
+  w->pool.ring =
+      (struct PooledTask *)calloc(POOL_SIZE, sizeof(struct PooledTask));
+  if (!w->pool.ring)
+    return NULL;
+  calc_ctx_init(&w->pool.rng, seed + nthreads + t);
+  pool_refill(&w->pool);
+  w->capacity = capacity;
+  if (worker_configure(w, config) < 0)
+    return NULL;
+  w->bucket_mask = bucket_mask;
+  w->jobs = (struct Job *)shard_mem;
+  w->job_bucket = (int *)(shard_mem +
+                          arena_round((size_t)capacity * sizeof(struct Job)));
+  init_jobs(w);
+  return w;
 }
 
-static int alloc_job(void) {
-  for (int i = 0; i < MAX_JOBS; i++)
-    if (!jobs[i].active)
-      return i;
-  return -1;
+#if !defined(SERVER_NO_MAIN) || defined(SERVER_SIM)
+/* A worker's event handling apart from the event loop itself: the server's
+   loops call these when the kernel says so, sim when its clock does. */
+
+/* Drops ring position pos from the index, moving later entries of its
+   probe run back so none is left behind a hole. */
+static void wait_unindex(struct Worker *w, uint32_t pos) {
+  uint32_t s = w->waitq[pos].hash & (WAIT_INDEX - 1);
+  while (w->wait_index[s] != pos + 1)
+    s = (s + 1) & (WAIT_INDEX - 1);
+  for (uint32_t j = (s + 1) & (WAIT_INDEX - 1); w->wait_index[j];
+       j = (j + 1) & (WAIT_INDEX - 1)) {
+    uint32_t home = w->waitq[w->wait_index[j] - 1].hash & (WAIT_INDEX - 1);
+    if (((j - home) & (WAIT_INDEX - 1)) >= ((j - s) & (WAIT_INDEX - 1))) {
+      w->wait_index[s] = w->wait_index[j];
+      s = j;
+    }
+  }
+  w->wait_index[s] = 0;
+}
+
+/* Hands free slots to parked requests in arrival order; ones that have
+   waited the full -q delay get NOT OK instead. The delay is the one in
+   effect now, so after a reload deadlines still run in queue order. */
+static void serve_waiters(struct Worker *w) {
+  if (w->wait_count == 0)
+    return;
+  uint64_t now = now_ms();
+  while (w->wait_count > 0) {
+    struct Waiter q = w->waitq[w->wait_head];
+    int late = now >= q.since_ms + w->cfg->queue_delay_ms;
+    if (!late && table_full(w))
+      break;
+    wait_unindex(w, w->wait_head);
+    w->wait_head = (w->wait_head + 1) & (WAIT_MAX - 1);
+    w->wait_count--;
+    w->reply_text = q.text;
+    if (late)
+      send_busy(w, q.sock, &q.addr, q.addr_len);
+    else if (q.ntasks)
+      assign_batch(w, q.sock, &q.addr, q.addr_len, q.ntasks);
+    else
+      assign_task(w, q.sock, &q.addr, q.addr_len);
+    w->reply_text = 0;
+  }
 }
 
-static void expire_jobs(void) {
-  time_t now = time(NULL);
-  for (int i = 0; i < MAX_JOBS; i++)
-    if (jobs[i].active && difftime(now, jobs[i].assigned_at) >= JOB_TIMEOUT)
-      jobs[i].active = 0;
+/* Absolute monotonic ms at which worker_tick() is next due: the wheel's
+   next tick or the oldest waiter's deadline, whichever is first; 0 if
+   there is neither. */
+static uint64_t worker_deadline_ms(const struct Worker *w) {
+  uint64_t deadline = wheel_deadline_ms(w);
+  if (w->wait_count > 0) {
+    uint64_t d = w->waitq[w->wait_head].since_ms + w->cfg->queue_delay_ms;
+    if (deadline == 0 || d < deadline)
+      deadline = d;
+  }
+  return deadline;
 }
 
-static void send_calc_msg(int sock, const struct sockaddr_storage *addr,
-                          socklen_t len, uint16_t type, uint32_t message) {
-  struct calcMessage m;
-  memset(&m, 0, sizeof(m));
-  m.type = htons(type);
-  m.message = htonl(message);
-  m.protocol = htons(17);
-  m.major_version = htons(1);
-  m.minor_version = htons(0);
-  sendto(sock, &m, sizeof(m), 0, (const struct sockaddr *)addr, len);
+/* One batch of datagrams waiting on sock, handled and answered. */
+static void worker_receive(struct Worker *w, int sock) {
+  int n = transport->recv(w, sock, &w->rx);
+  if (n > 0)
+    STAT_ADD(w, packets_in, n);
+  uint64_t t0 = now_ns();
+  for (int i = 0; i < n; i++) {
+    handle_packet(w, sock, w->rx.bufs[i], w->rx.msgs[i].msg_len,
+                  &w->rx.addrs[i], w->rx.msgs[i].msg_hdr.msg_namelen);
+    uint64_t t1 = now_ns();
+    record_handle_time(w, t1 - t0);
+    t0 = t1;
+  }
+  serve_waiters(w);
+  flush_replies(w);
 }
 
-static void assign_task(int sock, const struct sockaddr_storage *addr,
-                        socklen_t len) {
-  int slot = alloc_job();
-  if (slot < 0) {
-    send_calc_msg(sock, addr, len, 2, 2);
+/* Timer work: expired jobs, waiters whose slot or deadline has come, and
+   a capture buffer that has waited long enough. */
+static void worker_tick(struct Worker *w) {
+  expire_jobs(w);
+  serve_waiters(w);
+  flush_replies(w);
+  if (w->cap_len && now_ms() - w->cap_flushed_ms >= CAPTURE_FLUSH_MS)
+    capture_flush(w);
+}
+#endif
+
+#ifndef SERVER_NO_MAIN // bench.cpp includes this file for the hot path
+/* epoll data for a connection slot; everything else registers its fd. */
+#define CONN_TAG(slot) ((uint64_t)1 << 32 | (uint32_t)(slot))
+
+static void conn_close(struct Worker *w, struct Conn *c) {
+  epoll_ctl(w->ep, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  c->fd = -1;
+  c->in = c->out = NULL;
+  /* Jobs still out on this connection are left to expire. */
+}
+
+static void conn_accept(struct Worker *w, int lsock) {
+  for (;;) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int fd = accept4(lsock, (struct sockaddr *)&addr, &len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+    int slot = 0;
+    while (slot < CONN_MAX && w->conns[slot].fd >= 0)
+      slot++;
+    struct Conn *c = &w->conns[slot];
+    if (slot == CONN_MAX || !(c->in = (char *)malloc(CONN_IN)) ||
+        !(c->out = (char *)malloc(CONN_OUT))) {
+      if (slot < CONN_MAX) {
+        free(c->in);
+        c->in = NULL;
+      }
+      close(fd);
+      continue;
+    }
+    /* Replies are already coalesced per wakeup; don't let Nagle hold the
+       last one back. */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd = fd;
+    memcpy(&c->addr, &addr, len);
+    c->addr_len = len;
+    c->in_len = c->out_len = c->out_off = 0;
+    c->text = -1;
+    c->events = EPOLLIN;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events;
+    ev.data.u64 = CONN_TAG(slot);
+    if (epoll_ctl(w->ep, EPOLL_CTL_ADD, fd, &ev) < 0)
+      conn_close(w, c);
+  }
+}
+
+/* Writes out as much of the queued replies as the socket takes. */
+static int conn_flush(struct Conn *c) {
+  while (c->out_off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    c->out_off += n;
+  }
+  c->out_len = c->out_off = 0;
+  return 0;
+}
+
+/* Handles every complete frame there is room to answer, sends the replies
+   and sets what to wait for next: more input while replies still fit,
+   writability while some are queued. */
+static void conn_service(struct Worker *w, struct Conn *c) {
+  int off = 0;
+  uint64_t t0 = now_ns();
+  /* A frame length never starts with a printable byte. */
+  if (c->text < 0 && c->in_len > 0)
+    c->text = (unsigned char)c->in[0] > (PKT_MAX >> 8);
+  while (c->text > 0) {
+    const char *line = c->in + off;
+    const char *nl = (const char *)memchr(line, '\n', c->in_len - off);
+    if (!nl) {
+      if (c->in_len - off >= CALC_TEXT_LINE_MAX) {
+        conn_close(w, c);
+        return;
+      }
+      break;
+    }
+    if (c->out_len + CALC_TEXT_LINE_MAX > CONN_OUT)
+      break;
+
+    STAT_ADD(w, packets_in, 1);
+    w->reply_conn = c;
+    handle_text(w, -1, line, nl - line, &c->addr, c->addr_len);
+    w->reply_conn = NULL;
+    uint64_t t1 = now_ns();
+    record_handle_time(w, t1 - t0);
+    t0 = t1;
+    off += nl + 1 - line;
+  }
+  while (c->text == 0 && c->in_len - off >= FRAME_HDR) {
+    const unsigned char *f = (const unsigned char *)c->in + off;
+    int flen = f[0] << 8 | f[1];
+    if (flen == 0 || flen > PKT_MAX) {
+      conn_close(w, c);
+      return;
+    }
+    if (c->in_len - off < FRAME_HDR + flen)
+      break;
+    if (c->out_len + FRAME_HDR + PKT_MAX > CONN_OUT)
+      break; // wait for the peer to read its replies
+
+    STAT_ADD(w, packets_in, 1);
+    w->reply_conn = c;
+    handle_packet(w, -1, c->in + off + FRAME_HDR, flen, &c->addr,
+                  c->addr_len);
+    w->reply_conn = NULL;
+    uint64_t t1 = now_ns();
+    record_handle_time(w, t1 - t0);
+    t0 = t1;
+    off += FRAME_HDR + flen;
+  }
+  if (off > 0) {
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+  }
+  if (conn_flush(c) < 0) {
+    conn_close(w, c);
     return;
   }
 
-  struct calcProtocol p;
-  memset(&p, 0, sizeof(p));
-  p.type = htons(1);
-  p.major_version = htons(1);
-  p.minor_version = htons(0);
+  uint32_t events = 0;
+  if (c->in_len < CONN_IN && c->out_len + FRAME_HDR + PKT_MAX <= CONN_OUT)
+    events |= EPOLLIN;
+  if (c->out_len > 0)
+    events |= EPOLLOUT;
+  if (events != c->events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = CONN_TAG(c - w->conns);
+    epoll_ctl(w->ep, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+  }
+}
 
-  static uint32_t next_id = 1;
-  uint32_t id = next_id++;
-  if (next_id == 0)
-    next_id = 1;
-  p.id = htonl(id);
+static void conn_event(struct Worker *w, struct Conn *c, uint32_t events) {
+  if (events & EPOLLIN) {
+    while (c->in_len < CONN_IN) {
+      ssize_t n = recv(c->fd, c->in + c->in_len, CONN_IN - c->in_len,
+                       MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        conn_close(w, c);
+        return;
+      }
+      if (n < 0)
+        break;
+      c->in_len += n;
+    }
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    conn_close(w, c);
+    return;
+  }
+  conn_service(w, c);
+}
 
-  int arith = (rand() % 8) + 1;
-  p.arith = htonl(arith);
+static int uring_backend; // -B uring: workers try io_uring before epoll
 
-  if (arith <= 4) {
-    int32_t v1 = randomInt();
-    int32_t v2 = randomInt();
-    p.inValue1 = htonl(v1);
-    p.inValue2 = htonl(v2);
-    p.inResult = htonl(0);
-  } else {
-    double f1 = randomFloat();
-    double f2 = randomFloat();
-    p.flValue1 = f1;
-    p.flValue2 = f2;
-    p.flResult = 0.0;
-  }
-
-  jobs[slot].active = 1;
-  memcpy(&jobs[slot].addr, addr, len);
-  jobs[slot].addr_len = len;
-  jobs[slot].id = id;
-  memcpy(&jobs[slot].task, &p, sizeof(p));
-  jobs[slot].task.type = 1;
-  jobs[slot].task.major_version = 1;
-  jobs[slot].task.minor_version = 0;
-  jobs[slot].task.id = id;
-  jobs[slot].task.arith = arith;
-  jobs[slot].task.inValue1 = ntohl(p.inValue1);
-  jobs[slot].task.inValue2 = ntohl(p.inValue2);
-  jobs[slot].task.inResult = 0;
-  jobs[slot].assigned_at = time(NULL);
-
-  sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)addr, len);
-}
-
-static int compute_int(const struct calcProtocol *t, int32_t *out) {
-  switch (t->arith) {
-  case 1:
-    *out = t->inValue1 + t->inValue2;
-    return 1;
-  case 2:
-    *out = t->inValue1 - t->inValue2;
-    return 1;
-  case 3:
-    *out = t->inValue1 * t->inValue2;
-    return 1;
-  case 4:
-    *out = (t->inValue2 != 0) ? t->inValue1 / t->inValue2 : 0;
-    return 1;
-  default:
-    return 0;
+/* Switches to the configuration main() published, if it hasn't yet. If
+   it can't be applied the worker stays on the one it has, says so through
+   config_failed for main() to report, and tries again next time. A new
+   timeout applies to the jobs already out too, so they are filed on the
+   wheel again; ones it has already run out for go on the next tick. */
+static void config_sync(struct Worker *w) {
+  const struct Config *c = __atomic_load_n(&config, __ATOMIC_ACQUIRE);
+  if (c == w->cfg)
+    return;
+  uint32_t timeout_ms = w->cfg->timeout_ms;
+  if (worker_configure(w, c) < 0) {
+    __atomic_store_n(&w->config_failed, c, __ATOMIC_RELEASE);
+    return;
   }
+  if (c->timeout_ms != timeout_ms)
+    for (int i = 0; i < w->capacity; i++)
+      if (w->jobs[i].active) {
+        wheel_remove(w, i);
+        wheel_insert(w, i, job_expiry_tick(w, i));
+      }
 }
 
-static int compute_double(const struct calcProtocol *t, double *out) {
-  switch (t->arith) {
-  case 5:
-    *out = t->flValue1 + t->flValue2;
-    return 1;
-  case 6:
-    *out = t->flValue1 - t->flValue2;
-    return 1;
-  case 7:
-    *out = t->flValue1 * t->flValue2;
+/* Keeps the timerfd pointed at the worker's next deadline. */
+static void arm_timer(struct Worker *w, int tfd, uint64_t *armed) {
+  uint64_t deadline = worker_deadline_ms(w);
+  if (deadline == *armed)
+    return;
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline / 1000;
+  its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+  *armed = deadline;
+}
+
+/* Handles one epoll event; returns 0 once the worker is told to stop. */
+static int worker_event(struct Worker *w, const struct epoll_event *ev,
+                        int tfd, uint64_t *armed) {
+  if (ev->data.u64 >> 32) {
+    struct Conn *c = &w->conns[(uint32_t)ev->data.u64];
+    if (c->fd >= 0)
+      conn_event(w, c, ev->events);
+    if (w->wait_count > 0) { // slots TCP results gave back
+      serve_waiters(w);
+      flush_replies(w);
+    }
     return 1;
-  case 8:
-    *out = (t->flValue2 != 0.0) ? t->flValue1 / t->flValue2 : 0.0;
+  }
+  int fd = (int)ev->data.u64;
+  for (int i = 0; i < w->nlsocks; i++)
+    if (fd == w->lsocks[i]) {
+      conn_accept(w, fd);
+      return 1;
+    }
+  if (fd == w->efd) {
+    uint64_t wake = 0;
+    if (read(w->efd, &wake, sizeof(wake)) != sizeof(wake))
+      return 1;
+    if (wake & WAKE_CONFIG)
+      config_sync(w);
+    return !(wake & WAKE_STOP);
+  }
+  if (fd == tfd) {
+    uint64_t ticks;
+    if (read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks))
+      *armed = 0;
+    worker_tick(w);
     return 1;
-  default:
-    return 0;
   }
+  worker_receive(w, fd);
+  return 1;
 }
 
-static void handle_packet(int sock, const char *buf, ssize_t n,
-                          const struct sockaddr_storage *addr, socklen_t len) {
-  if ((size_t)n == sizeof(struct calcMessage)) {
-    struct calcMessage m;
-    memcpy(&m, buf, sizeof(m));
-    uint16_t type = ntohs(m.type);
-    uint32_t msg = ntohl(m.message);
-    uint16_t proto = ntohs(m.protocol);
-    uint16_t maj = ntohs(m.major_version);
-    uint16_t min = ntohs(m.minor_version);
-
-    if (type == 22 && msg == 0 && proto == 17 && maj == 1 && min == 0)
-      assign_task(sock, addr, len);
-    else
-      send_calc_msg(sock, addr, len, 2, 2);
-    return;
+static void epoll_loop(struct Worker *w, int tfd) {
+  int running = 1;
+  uint64_t armed = 0;
+  struct epoll_event evs[MAX_EVENTS];
+  while (running) {
+    arm_timer(w, tfd, &armed);
+    int nev = epoll_wait(w->ep, evs, MAX_EVENTS, -1);
+    config_sync(w);
+    for (int e = 0; e < nev; e++)
+      running &= worker_event(w, &evs[e], tfd, &armed);
   }
+}
 
-  if ((size_t)n == sizeof(struct calcProtocol)) {
-    struct calcProtocol r;
-    memcpy(&r, buf, sizeof(r));
-    r.type = ntohs(r.type);
-    r.major_version = ntohs(r.major_version);
-    r.minor_version = ntohs(r.minor_version);
-    r.id = ntohl(r.id);
-    r.arith = ntohl(r.arith);
-    r.inValue1 = ntohl(r.inValue1);
-    r.inValue2 = ntohl(r.inValue2);
-    r.inResult = ntohl(r.inResult);
-
-    int idx = find_job_addr(addr, len);
-    if (idx < 0) {
-      send_calc_msg(sock, addr, len, 2, 2);
-      return;
-    }
+/* Ring, receive buffers and the recvmsg template for one worker; on
+   failure the worker runs the epoll loop instead. */
+static int uring_setup(struct Worker *w) {
+  if (uring_init(&w->ring, UR_SQ_ENTRIES, UR_CQ_ENTRIES) < 0)
+    return -1;
+  if (uring_bufs_init(&w->ring, &w->rbufs, UR_BGID, UR_BUFS, UR_BUF_SIZE) <
+      0) {
+    uring_bufs_free(&w->rbufs);
+    uring_exit(&w->ring);
+    return -1;
+  }
+  memset(&w->ur_msg, 0, sizeof(w->ur_msg));
+  w->ur_msg.msg_namelen = sizeof(struct sockaddr_storage);
+  return 0;
+}
 
-    if (difftime(time(NULL), jobs[idx].assigned_at) >= JOB_TIMEOUT) {
-      jobs[idx].active = 0;
-      send_calc_msg(sock, addr, len, 2, 2);
-      return;
+static void uring_teardown(struct Worker *w) {
+  uring_exit(&w->ring);
+  uring_bufs_free(&w->rbufs);
+}
+
+/* Next SQE, submitting what is queued if the SQ is full. */
+static struct io_uring_sqe *uring_next_sqe(struct Worker *w) {
+  struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+  if (!sqe) {
+    uring_enter(&w->ring, 0);
+    sqe = uring_sqe(&w->ring);
+  }
+  return sqe;
+}
+
+/* One multishot recvmsg on socks[i]: a CQE per datagram, each in a buffer
+   the kernel takes from the provided ring. */
+static void uring_arm_recv(struct Worker *w, int i) {
+  struct io_uring_sqe *sqe = uring_next_sqe(w);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = w->socks[i];
+  sqe->addr = (uint64_t)(uintptr_t)&w->ur_msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UR_BGID;
+  sqe->user_data = UR_TAG(UR_RECV, i);
+}
+
+/* The listeners, TCP connections, timerfd and eventfd stay on the epoll
+   instance; a multishot poll on it says when to look there. */
+static void uring_arm_poll(struct Worker *w) {
+  struct io_uring_sqe *sqe = uring_next_sqe(w);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = w->ep;
+  sqe->poll32_events = EPOLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = UR_TAG(UR_POLL, 0);
+}
+
+static void uring_recv(struct Worker *w, const struct io_uring_cqe *cqe,
+                       uint64_t *t0) {
+  int i = (uint32_t)cqe->user_data;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    const struct io_uring_recvmsg_out *o =
+        (const struct io_uring_recvmsg_out *)(w->rbufs.mem +
+                                              (size_t)bid * UR_BUF_SIZE);
+    if (cqe->res > 0 && o->namelen <= w->ur_msg.msg_namelen) {
+      const char *name = (const char *)(o + 1);
+      const char *payload = name + w->ur_msg.msg_namelen;
+      /* Cut to PKT_MAX like a recvmmsg() into rx.bufs would. */
+      ssize_t n = o->payloadlen < PKT_MAX ? o->payloadlen : PKT_MAX;
+      STAT_ADD(w, packets_in, 1);
+      handle_packet(w, w->socks[i], payload, n,
+                    (const struct sockaddr_storage *)name, o->namelen);
+      uint64_t t1 = now_ns();
+      record_handle_time(w, t1 - *t0);
+      *t0 = t1;
     }
-    if (jobs[idx].id != r.id) {
-      send_calc_msg(sock, addr, len, 2, 2);
-      return;
+    uring_buf_put(&w->rbufs, bid);
+    uring_bufs_publish(&w->rbufs);
+  }
+  /* Out of buffers or some other stop: start over once this batch has
+     handed its buffers back. */
+  if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -EBADF)
+    uring_arm_recv(w, i);
+}
+
+static void uring_loop(struct Worker *w, int tfd) {
+  for (int i = 0; i < w->nsocks; i++)
+    uring_arm_recv(w, i);
+  uring_arm_poll(w);
+
+  int running = 1;
+  int ep_ready = 0; // epoll may hold events we haven't collected yet
+  uint64_t armed = 0;
+  struct epoll_event evs[MAX_EVENTS];
+  while (running) {
+    arm_timer(w, tfd, &armed);
+    if (uring_enter(&w->ring, ep_ready ? 0 : 1) < 0 && errno != EAGAIN &&
+        errno != EBUSY)
+      break;
+    config_sync(w);
+
+    uint64_t t0 = now_ns();
+    while (uring_cq_ready(&w->ring) > 0) {
+      struct io_uring_cqe cqe = *uring_cqe(&w->ring, 0);
+      uring_cq_advance(&w->ring, 1);
+      switch (cqe.user_data >> 32) {
+      case UR_RECV:
+        uring_recv(w, &cqe, &t0);
+        break;
+      case UR_POLL:
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+          uring_arm_poll(w);
+        ep_ready = 1;
+        break;
+      }
     }
+    serve_waiters(w);
+    flush_replies(w);
 
-    int ok = 0;
-    if (r.arith <= 4) {
-      int32_t exp;
-      if (compute_int(&jobs[idx].task, &exp))
-        ok = (exp == r.inResult);
-    } else {
-      double exp;
-      if (compute_double(&jobs[idx].task, &exp))
-        ok = (fabs(exp - r.flResult) < 1e-6);
+    /* Level-triggered sources that were already ready don't wake the poll
+       again, so keep collecting until epoll comes back empty. */
+    if (ep_ready) {
+      int nev = epoll_wait(w->ep, evs, MAX_EVENTS, 0);
+      for (int e = 0; e < nev; e++)
+        running &= worker_event(w, &evs[e], tfd, &armed);
+      ep_ready = nev > 0;
     }
+  }
+}
+
+static void *worker_main(void *arg) {
+  struct Worker *w = (struct Worker *)arg;
+
+  if (capture_fd >= 0 && !(w->cap_buf = (char *)malloc(CAPTURE_BUF))) {
+#ifdef DEBUG
+    printf("CAPTURE BUFFER ALLOCATION FAILED\n");
+#endif
+  }
+
+  if (uring_backend && uring_setup(w) < 0) {
+#ifdef DEBUG
+    printf("IO_URING SETUP FAILED, USING EPOLL\n");
+#endif
+  }
+
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  w->ep = ep;
+  if (tfd < 0 || ep < 0) {
+#ifdef DEBUG
+    printf("EPOLL SETUP FAILED\n");
+#endif
+    return NULL;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  /* With io_uring the UDP sockets are read by the ring instead. */
+  for (int i = 0; i < w->nsocks && w->ring.fd < 0; i++) {
+    ev.data.u64 = w->socks[i];
+    epoll_ctl(ep, EPOLL_CTL_ADD, w->socks[i], &ev);
+  }
+  for (int i = 0; i < w->nlsocks; i++) {
+    ev.data.u64 = w->lsocks[i];
+    epoll_ctl(ep, EPOLL_CTL_ADD, w->lsocks[i], &ev);
+  }
+  ev.data.u64 = w->efd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, w->efd, &ev);
+  ev.data.u64 = tfd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+
+  if (w->ring.fd >= 0)
+    uring_loop(w, tfd);
+  else
+    epoll_loop(w, tfd);
+
+  uring_teardown(w);
+  if (w->cap_buf) {
+    capture_flush(w);
+    free(w->cap_buf);
+    w->cap_buf = NULL;
+  }
+  for (int i = 0; i < CONN_MAX; i++)
+    if (w->conns[i].fd >= 0)
+      conn_close(w, &w->conns[i]);
+  close(ep);
+  close(tfd);
+  return NULL;
+}
+
+static int state_fd = -1; // holds the lock that keeps a second server out
 
-    send_calc_msg(sock, addr, len, 2, ok ? 1 : 2);
-    jobs[idx].active = 0;
+/* This boot's ID, "" if it can't be read. */
+static void read_boot_id(char *id, size_t size) {
+  memset(id, 0, size);
+  FILE *f = fopen("/proc/sys/kernel/random/boot_id", "re");
+  if (!f)
     return;
+  if (fgets(id, size, f))
+    id[strcspn(id, "\n")] = '\0';
+  fclose(f);
+}
+
+static uint64_t realtime_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Maps a --state-file of <bytes> bytes, header included, and locks it. An
+   empty file, or one whose header was never finished, becomes a fresh
+   table; a file from an earlier run is attached (*attached set) if its
+   header matches want up to the clocks, and refused otherwise. Returns
+   NULL after printing why the file can't be used. */
+static struct StateHeader *state_map(const char *path, size_t bytes,
+                                     const struct StateHeader *want,
+                                     int *attached) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("ERROR: cannot open state file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    printf("ERROR: state file %s is in use by another server\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  struct StateHeader h;
+  memset(&h, 0, sizeof(h));
+  if (pread(fd, &h, sizeof(h), 0) < 0)
+    memset(&h, 0, sizeof(h));
+  static const char unset[sizeof(h.magic)] = {0};
+  int fresh = memcmp(h.magic, unset, sizeof(h.magic)) == 0;
+  if (!fresh && (memcmp(&h, want, offsetof(struct StateHeader, mono_ms)) !=
+                     0 ||
+                 (size_t)st.st_size != bytes)) {
+    printf("ERROR: state file %s holds another table (version %u, %u x %u "
+           "sessions); remove it or start with the same -t and -m\n",
+           path, h.version, h.threads, h.per_shard);
+    close(fd);
+    return NULL;
+  }
+  if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, bytes) < 0)) {
+    printf("ERROR: cannot size state file %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
   }
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, 0);
+  if (p == MAP_FAILED) {
+    printf("ERROR: cannot map state file %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  struct StateHeader *sh = (struct StateHeader *)p;
+  if (fresh) {
+    /* The magic goes in last: a file cut short before that is fresh. */
+    *sh = *want;
+    memset(sh->magic, 0, sizeof(sh->magic));
+    if (getrandom(sh->cookie_key, sizeof(sh->cookie_key), 0) !=
+        sizeof(sh->cookie_key)) {
+      printf("ERROR: no random key for task cookies\n");
+      close(fd);
+      return NULL;
+    }
+    memcpy(sh->magic, want->magic, sizeof(sh->magic));
+  }
+  state_fd = fd;
+  *attached = !fresh;
+  return sh;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] <IP-or-DNS:PORT>\n"
+         "  -b, --batch N     datagrams per recvmmsg()/sendmmsg() (1..%d, "
+         "default %d)\n"
+         "  -t, --threads N   worker threads, each on its own SO_REUSEPORT "
+         "socket (1..%d, default 1)\n"
+         "  -m, --max-sessions N  concurrent sessions across all threads "
+         "(default %d)\n"
+         "  -H, --hugepages   back the session table with huge pages\n"
+         "  -B, --backend B   UDP I/O: epoll (recvmmsg/sendmmsg, default) "
+         "or uring\n"
+         "  -S, --stateless   binary tasks carry signed cookies instead of "
+         "session slots\n"
+         "  -c, --capture FILE  log every UDP datagram in and out to FILE "
+         "(see replay)\n"
+         "  -r, --rate-limit R[:B]    new sessions per second from one "
+         "address, bursts of B (default R)\n"
+         "  -R, --subnet-limit R[:B]  the same per /%d (IPv4) or /%d (IPv6) "
+         "subnet\n"
+         "  -q, --queue-delay MS  with the table full, UDP requests wait up "
+         "to MS for a slot\n"
+         "  -a, --retry-after MS  NOT OK to a request that got no slot says "
+         "retry in MS (1..%d)\n"
+         "  -f, --state-file FILE  keep the session table in FILE; a restart "
+         "resumes its sessions\n"
+         "  -C, --config FILE  settings that SIGHUP re-reads: timeout, "
+         "sessions, rate-limit,\n"
+         "                     subnet-limit, queue-delay, retry-after; one "
+         "\"name value\" a line\n",
+         prog, BATCH_MAX, BATCH_DEFAULT, MAX_THREADS, MAX_SESSIONS_DEFAULT,
+         RL_V4_PREFIX, RL_V6_PREFIX, RETRY_AFTER_MAX);
+}
+
+/* "RATE[:BURST]" for -r and -R. */
+static int parse_limit(const char *arg, struct RateLimit *l) {
+  char *end;
+  unsigned long rate = strtoul(arg, &end, 10), burst = rate;
+  if (*end == ':')
+    burst = strtoul(end + 1, &end, 10);
+  if (*end != '\0' || rate < 1 || rate > RL_MAX || burst < 1 ||
+      burst > RL_MAX)
+    return -1;
+  l->rate = rate;
+  l->burst = burst;
+  return 0;
+}
+
+/* A --config value from lo to hi; "off" is 0 where off_ok. */
+static int parse_setting(const char *arg, uint32_t lo, uint32_t hi,
+                         int off_ok, uint32_t *v) {
+  if (off_ok && strcmp(arg, "off") == 0) {
+    *v = 0;
+    return 0;
+  }
+  char *end;
+  unsigned long n = strtoul(arg, &end, 10);
+  if (*end != '\0' || end == arg || n < lo || n > hi)
+    return -1;
+  *v = n;
+  return 0;
+}
+
+/* Reads a --config file into c, starting from base (the command line).
+   Each line is a setting's name and value; a setting left out keeps
+   base's value, so deleting a line and reloading undoes it. Blank lines
+   and '#' comments are skipped. sessions can't exceed table, the slots
+   allocated at startup. Returns -1 after printing what is wrong; nothing
+   of a bad file is used. */
+static int config_load(const char *path, const struct Config *base,
+                       uint32_t table, struct Config *c) {
+  FILE *f = fopen(path, "re");
+  if (!f) {
+    printf("ERROR: cannot read config %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  *c = *base;
+  c->prev = NULL;
+  char line[256];
+  int lineno = 0, bad = 0;
+  while (!bad && fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    char name[32], value[64], extra[2];
+    int n = sscanf(line, "%31s %63s %1s", name, value, extra);
+    if (n <= 0)
+      continue;
+    if (n != 2)
+      bad = 1;
+    else if (strcmp(name, "timeout") == 0)
+      bad = parse_setting(value, 1, JOB_TIMEOUT_MAX, 0, &c->timeout_ms);
+    else if (strcmp(name, "sessions") == 0)
+      bad = parse_setting(value, 1, table, 0, &c->sessions);
+    else if (strcmp(name, "rate-limit") == 0 ||
+             strcmp(name, "subnet-limit") == 0) {
+      struct RateLimit *l = name[0] == 'r' ? &c->source : &c->subnet;
+      if (strcmp(value, "off") == 0)
+        l->rate = l->burst = 0;
+      else
+        bad = parse_limit(value, l);
+    } else if (strcmp(name, "queue-delay") == 0)
+      bad = parse_setting(value, 1, JOB_TIMEOUT_MAX, 1, &c->queue_delay_ms);
+    else if (strcmp(name, "retry-after") == 0)
+      bad = parse_setting(value, 1, RETRY_AFTER_MAX, 1, &c->retry_after_ms);
+    else
+      bad = 1;
+  }
+  fclose(f);
+  if (bad) {
+    printf("ERROR: config %s line %d: not a setting, or out of range\n", path,
+           lineno);
+    return -1;
+  }
+  if (c->queue_delay_ms > c->timeout_ms) {
+    printf("ERROR: config %s: queue-delay is longer than timeout\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Allocates the rate limit tables c turns on that no earlier configuration
+   did, before c is published; -1 if one can't be. */
+static int rl_tables_alloc(const struct Config *c) {
+  if ((c->source.rate && !rl_source && !(rl_source = rl_table_new())) ||
+      (c->subnet.rate && !rl_subnet && !(rl_subnet = rl_table_new()))) {
+    printf("ERROR: cannot allocate a rate limit table\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* One line with every setting of c in effect. */
+static void config_log(const char *what, const struct Config *c) {
+  char source[32] = "off", subnet[32] = "off";
+  char queue[16] = "off", retry[16] = "off";
+  if (c->source.rate)
+    snprintf(source, sizeof(source), "%u/s:%u", c->source.rate,
+             c->source.burst);
+  if (c->subnet.rate)
+    snprintf(subnet, sizeof(subnet), "%u/s:%u", c->subnet.rate,
+             c->subnet.burst);
+  if (c->queue_delay_ms)
+    snprintf(queue, sizeof(queue), "%u ms", c->queue_delay_ms);
+  if (c->retry_after_ms)
+    snprintf(retry, sizeof(retry), "%u ms", c->retry_after_ms);
+  printf("%s: timeout %u ms, %u sessions, rate limit %s, subnet limit %s, "
+         "queue delay %s, retry hint %s\n",
+         what, c->timeout_ms, c->sessions, source, subnet, queue, retry);
+  fflush(stdout);
+}
 
-  send_calc_msg(sock, addr, len, 2, 2);
+/* Wakes every worker to take up c, just published, and logs the outcome
+   once they all have. */
+static void reload_workers(struct Worker **workers, int nthreads,
+                           const struct Config *c) {
+  uint64_t wake = WAKE_CONFIG;
+  for (int t = 0; t < nthreads; t++)
+    if (write(workers[t]->efd, &wake, sizeof(wake)) != sizeof(wake))
+      printf("Config: cannot wake thread %d\n", t);
+  int pending = nthreads, failed = 0;
+  for (int ms = 0; pending > 0 && ms < CONFIG_WAIT_MS; ms++) {
+    usleep(1000);
+    pending = failed = 0;
+    for (int t = 0; t < nthreads; t++) {
+      struct Worker *w = workers[t];
+      if (__atomic_load_n(&w->cfg, __ATOMIC_ACQUIRE) == c)
+        continue;
+      if (__atomic_load_n(&w->config_failed, __ATOMIC_ACQUIRE) == c)
+        failed++;
+      else
+        pending++;
+    }
+  }
+  config_log(failed || pending ? "Config published" : "Config reloaded", c);
+  if (failed)
+    printf("Config: %d thread%s could not allocate for it and kept the "
+           "previous settings; they try again on every wakeup\n",
+           failed, failed == 1 ? "" : "s");
+  if (pending)
+    printf("Config: %d thread%s not switched over after %d ms\n", pending,
+           pending == 1 ? "" : "s", CONFIG_WAIT_MS);
+  fflush(stdout);
 }
 
 int main(int argc, char *argv[]) {
+  int batch = BATCH_DEFAULT;
+  int nthreads = 1;
+  long max_sessions = MAX_SESSIONS_DEFAULT;
+  int hugepages = 0;
+  const char *capture_path = NULL;
+  const char *state_path = NULL;
+  const char *config_path = NULL;
+
+  static const struct option opts[] = {
+      {"batch", required_argument, NULL, 'b'},
+      {"threads", required_argument, NULL, 't'},
+      {"max-sessions", required_argument, NULL, 'm'},
+      {"hugepages", no_argument, NULL, 'H'},
+      {"backend", required_argument, NULL, 'B'},
+      {"stateless", no_argument, NULL, 'S'},
+      {"capture", required_argument, NULL, 'c'},
+      {"rate-limit", required_argument, NULL, 'r'},
+      {"subnet-limit", required_argument, NULL, 'R'},
+      {"queue-delay", required_argument, NULL, 'q'},
+      {"retry-after", required_argument, NULL, 'a'},
+      {"state-file", required_argument, NULL, 'f'},
+      {"config", required_argument, NULL, 'C'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:t:m:HB:Sc:r:R:q:a:f:C:", opts,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      batch = atoi(optarg);
+      if (batch < 1 || batch > BATCH_MAX) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1 || nthreads > MAX_THREADS) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    case 'm':
+      max_sessions = atol(optarg);
+      if (max_sessions < 1 || max_sessions > MAX_SESSIONS_LIMIT) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    case 'H':
+      hugepages = 1;
+      break;
+    case 'B':
+      if (strcmp(optarg, "uring") == 0)
+        uring_backend = 1;
+      else if (strcmp(optarg, "epoll") != 0) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    case 'S':
+      stateless = 1;
+      break;
+    case 'c':
+      capture_path = optarg;
+      break;
+    case 'f':
+      state_path = optarg;
+      break;
+    case 'C':
+      config_path = optarg;
+      break;
+    case 'r':
+    case 'R':
+      if (parse_limit(optarg,
+                      opt == 'r' ? &boot_config.source : &boot_config.subnet) <
+          0) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    case 'q':
+      boot_config.queue_delay_ms = atoi(optarg);
+      if (boot_config.queue_delay_ms < 1 ||
+          boot_config.queue_delay_ms > JOB_TIMEOUT_MAX) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    case 'a':
+      boot_config.retry_after_ms = atoi(optarg);
+      if (boot_config.retry_after_ms < 1 ||
+          boot_config.retry_after_ms > RETRY_AFTER_MAX) {
+        printf("Wrong input arguments\n");
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
 
-  if (argc != 2) {
-    printf("Usage: %s <IP-or-DNS:PORT>\n", argv[0]);
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (hugepages && state_path) {
+    printf("Wrong input arguments\n"); // a file mapping can't use -H
     return 1;
   }
 
   char delim[] = ":";
-  char *Desthost = strtok(argv[1], delim);
+  char *Desthost = strtok(argv[optind], delim);
   char *Destport = strtok(NULL, delim);
   if (!Desthost || !Destport) {
     printf("Wrong input arguments\n");
     return 1;
   }
 
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = sigint_handler;
-  sigaction(SIGINT, &sa, NULL);
-  sigaction(SIGTERM, &sa, NULL);
+  /* Find out now rather than per worker whether the kernel has what the
+     io_uring backend needs (multishot recvmsg, provided buffer rings). */
+  if (uring_backend) {
+    struct Uring r;
+    struct UringBufs b;
+    memset(&b, 0, sizeof(b));
+    if (uring_init(&r, 8, 16) < 0 ||
+        uring_bufs_init(&r, &b, UR_BGID, 8, UR_BUF_SIZE) < 0) {
+      printf("io_uring unavailable (%s), using epoll\n", strerror(errno));
+      uring_backend = 0;
+    }
+    uring_bufs_free(&b);
+    uring_exit(&r);
+  }
 
-  struct sigaction sa2;
-  memset(&sa2, 0, sizeof(sa2));
-  sa2.sa_handler = sigalrm_handler;
-  sigaction(SIGALRM, &sa2, NULL);
+  if (stateless && !state_path &&
+      getrandom(cookie_key, sizeof(cookie_key), 0) != sizeof(cookie_key)) {
+    printf("ERROR: no random key for task cookies\n");
+    return 1;
+  }
 
-  struct itimerval alarmTime;
-  alarmTime.it_interval.tv_sec = 10;
-  alarmTime.it_interval.tv_usec = 10;
-  alarmTime.it_value.tv_sec = 10;
-  alarmTime.it_value.tv_usec = 10;
+  if (capture_path) {
+    struct captureHeader h;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+    h.start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    capture_t0 = now_ns();
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC;
+    capture_fd = open(capture_path, flags, 0644);
+    if (capture_fd < 0 || write(capture_fd, &h, sizeof(h)) != sizeof(h)) {
+      printf("ERROR: cannot write capture file %s\n", capture_path);
+      return 1;
+    }
+  }
 
-  setitimer(ITIMER_REAL, &alarmTime, NULL);
+  /* SIGINT/SIGTERM/SIGHUP arrive through a signalfd instead of a handler;
+     the mask is inherited by every worker. */
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGHUP);
+  sigprocmask(SIG_BLOCK, &sigs, NULL);
 
   struct addrinfo hints, *res;
   memset(&hints, 0, sizeof(hints));
@@ -301,53 +2715,264 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  int sock = -1;
-  struct addrinfo *rp;
-  for (rp = res; rp; rp = rp->ai_next) {
-    sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (sock < 0)
-      continue;
-    if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0)
-      break;
-    close(sock);
-    sock = -1;
+  uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+
+  /* Split the session capacity evenly over the shards and lay every
+     shard's table out in a single arena. */
+  int per_shard = (int)((max_sessions + nthreads - 1) / nthreads);
+  uint32_t bucket_mask;
+  size_t shard_size = shard_bytes(per_shard, &bucket_mask);
+  size_t arena_size = shard_size * nthreads;
+  int huge = 0;
+  char *arena;
+  struct StateHeader *sh = NULL;
+  int resumed = 0, same_boot = 0, rebooted = 0;
+  char boot_id[sizeof(((struct StateHeader *)0)->boot_id)];
+  if (state_path) {
+    /* Everything that decides the layout goes in the header, so a file
+       is only reused by a server that would lay the table out the same. */
+    struct StateHeader want;
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, STATE_MAGIC, sizeof(want.magic));
+    want.version = STATE_VERSION;
+    want.job_size = sizeof(struct Job);
+    want.threads = nthreads;
+    want.per_shard = per_shard;
+    want.shard_size = shard_size;
+    sh = state_map(state_path, STATE_HEADER + arena_size, &want, &resumed);
+    if (!sh)
+      return 1;
+    read_boot_id(boot_id, sizeof(boot_id));
+    same_boot = boot_id[0] &&
+                strncmp(boot_id, sh->boot_id, sizeof(boot_id)) == 0;
+    if (resumed && !same_boot && nthreads > 1) {
+      resumed = 0; // a fresh table, which keeps the cookie key
+      rebooted = 1;
+    } else if (resumed && !same_boot) {
+      state_rebase_ms = ((int64_t)now_ms() - (int64_t)realtime_ms()) -
+                        ((int64_t)sh->mono_ms - (int64_t)sh->real_ms);
+    }
+    memcpy(cookie_key, sh->cookie_key, sizeof(cookie_key));
+    state_attached = resumed;
+    arena = (char *)sh + STATE_HEADER;
+  } else {
+    arena = (char *)arena_alloc(&arena_size, hugepages, &huge);
+    if (!arena) {
+      printf("ERROR: cannot allocate %zu byte session table\n", arena_size);
+      return 1;
+    }
+  }
+
+  /* Workers start out under the --config file, if there is one. */
+  uint32_t table = (uint32_t)per_shard * nthreads;
+  boot_config.sessions = max_sessions;
+  if (config_path) {
+    struct Config *c = (struct Config *)malloc(sizeof(*c));
+    if (!c || config_load(config_path, &boot_config, table, c) < 0)
+      return 1;
+    c->prev = config;
+    config = c;
+  }
+  if (config->queue_delay_ms > config->timeout_ms) {
+    printf("ERROR: queue delay %u ms is longer than the %u ms timeout\n",
+           config->queue_delay_ms, config->timeout_ms);
+    return 1;
+  }
+  if (rl_tables_alloc(config) < 0)
+    return 1;
+
+  struct Worker **workers =
+      (struct Worker **)calloc(nthreads + 1, sizeof(struct Worker *));
+  for (int t = 0; t < nthreads; t++) {
+    struct Worker *w = worker_create(t, nthreads, per_shard, bucket_mask,
+                                     arena + shard_size * t, batch, seed);
+    if (!w) {
+#ifdef DEBUG
+      printf("WORKER ALLOCATION FAILED\n");
+#endif
+      return 1;
+    }
+
+    /* Serve every address the name resolves to, e.g. both families. With
+       several workers each one binds its own SO_REUSEPORT socket and the
+       kernel's 4-tuple hash keeps a client on the same shard. */
+    struct addrinfo *rp;
+    for (rp = res; rp && w->nsocks < MAX_SOCKS; rp = rp->ai_next) {
+      int sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+      if (sock < 0)
+        continue;
+      int one = 1;
+      if (rp->ai_family == AF_INET6)
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+      if (nthreads > 1)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+      if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0) {
+        w->socks[w->nsocks++] = sock;
+        continue;
+      }
+      close(sock);
+    }
+
+    /* TCP on the same addresses and port, sharded the same way. */
+    for (rp = res; rp && w->nlsocks < MAX_SOCKS; rp = rp->ai_next) {
+      int sock = socket(rp->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (sock < 0)
+        continue;
+      int one = 1;
+      if (rp->ai_family == AF_INET6)
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (nthreads > 1)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+      if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0 &&
+          listen(sock, SOMAXCONN) == 0) {
+        w->lsocks[w->nlsocks++] = sock;
+        continue;
+      }
+      close(sock);
+    }
+    w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->nsocks == 0 || w->efd < 0) {
+#ifdef DEBUG
+      printf("SOCK FAILURE\n");
+#endif
+      return 1;
+    }
+    workers[t] = w;
   }
   freeaddrinfo(res);
-  if (sock < 0) {
+  state_attached = 0;
+  if (sh) {
+    /* Stamped once the slots are on this run's clock; the pair stays
+       valid for the whole run, so a crash loses nothing. */
+    sh->mono_ms = now_ms();
+    sh->real_ms = realtime_ms();
+    memcpy(sh->boot_id, boot_id, sizeof(sh->boot_id));
+  }
+
+  int sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+  if (sfd < 0)
+    return 1;
+
+  all_workers = workers;
+  worker_count = nthreads;
+  started_ms = now_ms();
+
+  for (int t = 0; t < nthreads; t++)
+    if (pthread_create(&workers[t]->thread, NULL, worker_main, workers[t]) !=
+        0) {
 #ifdef DEBUG
-    printf("SOCK FAILURE\n");
+      printf("THREAD CREATE FAILED\n");
 #endif
+      return 1;
+    }
+
+  pthread_t generator;
+  if (pthread_create(&generator, NULL, generator_main, workers) != 0)
     return 1;
-  }
 
-  initCalcLib();
-  memset(jobs, 0, sizeof(jobs));
+  printf("Session table: %d x %d sessions, %zu bytes (%.1f MiB)%s\n",
+         nthreads, per_shard, arena_size, arena_size / 1048576.0,
+         huge ? " on huge pages" : "");
+  if (stateless)
+    printf("Stateless: binary tasks carry cookies, the table holds text "
+           "tasks only\n");
+  if (config->source.rate)
+    printf("Rate limit: %u/s, burst %u per address\n",
+           config->source.rate, config->source.burst);
+  if (config->subnet.rate)
+    printf("Rate limit: %u/s, burst %u per /%d or /%d subnet\n",
+           config->subnet.rate, config->subnet.burst, RL_V4_PREFIX,
+           RL_V6_PREFIX);
+  if (config->queue_delay_ms)
+    printf("Wait queue: up to %d requests per thread, %u ms each\n",
+           WAIT_MAX, config->queue_delay_ms);
+  if (config->retry_after_ms)
+    printf("Retry hint: NOT OK for a full table says retry in %u ms\n",
+           config->retry_after_ms);
+  if (state_path) {
+    uint64_t kept = 0;
+    for (int t = 0; t < nthreads; t++)
+      kept += workers[t]->stats.active;
+    if (resumed)
+      printf("State file: %s, resumed %llu sessions\n", state_path,
+             (unsigned long long)kept);
+    else if (rebooted)
+      printf("State file: %s, sessions dropped: written before a reboot, "
+             "and with -t > 1 clients reach other threads now\n",
+             state_path);
+    else
+      printf("State file: %s, new table\n", state_path);
+  }
+  if (capture_path)
+    printf("Capture: UDP datagrams in and out go to %s\n", capture_path);
+  printf("Server listening on %s:%s (%s, %d thread%s, %s)\n", Desthost,
+         Destport, workers[0]->nlsocks ? "UDP+TCP" : "UDP", nthreads,
+         nthreads == 1 ? "" : "s", uring_backend ? "io_uring" : "epoll");
 
-  printf("Server listening on %s:%s (UDP)\n", Desthost, Destport);
+  if (config_path)
+    config_log("Config", config);
 
-  while (!terminate_flag) {
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(sock, &rfds);
-    struct timeval tv = {1, 0};
-    int rv = select(sock + 1, &rfds, NULL, NULL, &tv);
-    if (rv > 0 && FD_ISSET(sock, &rfds)) {
-      char buf[1024];
-      struct sockaddr_storage cli;
-      socklen_t clen = sizeof(cli);
-      ssize_t n =
-          recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&cli, &clen);
-      if (n > 0)
-        handle_packet(sock, buf, n, &cli, clen);
+  /* SIGHUP loads the --config file again and publishes it whole; a file
+     that doesn't load leaves the running configuration alone. */
+  struct signalfd_siginfo si;
+  for (;;) {
+    if (read(sfd, &si, sizeof(si)) != sizeof(si))
+      continue;
+    if (si.ssi_signo != SIGHUP)
+      break;
+    if (!config_path) {
+      printf("SIGHUP: no --config file to read\n");
+      fflush(stdout);
+      continue;
     }
-    if (housekeeping_flag) {
-      expire_jobs();
-      housekeeping_flag = 0;
+    struct Config *c = (struct Config *)malloc(sizeof(*c));
+    if (!c || config_load(config_path, &boot_config, table, c) < 0 ||
+        rl_tables_alloc(c) < 0) {
+      printf("Config not reloaded, the last one stays in effect\n");
+      fflush(stdout);
+      free(c);
+      continue;
     }
-    expire_jobs();
+    c->prev = config;
+    __atomic_store_n(&config, c, __ATOMIC_RELEASE);
+    reload_workers(workers, nthreads, c);
   }
 
-  close(sock);
+  uint64_t stop = WAKE_STOP;
+  for (int t = 0; t < nthreads; t++)
+    if (write(workers[t]->efd, &stop, sizeof(stop)) != sizeof(stop))
+      return 1;
+  pthread_mutex_lock(&refill_lock);
+  generator_stop = 1;
+  pthread_cond_signal(&refill_cond);
+  pthread_mutex_unlock(&refill_lock);
+  pthread_join(generator, NULL);
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(workers[t]->thread, NULL);
+    for (int i = 0; i < workers[t]->nsocks; i++)
+      close(workers[t]->socks[i]);
+    for (int i = 0; i < workers[t]->nlsocks; i++)
+      close(workers[t]->lsocks[i]);
+    close(workers[t]->efd);
+  }
+  close(sfd);
+  if (capture_fd >= 0)
+    close(capture_fd);
+  if (sh) {
+    msync(sh, STATE_HEADER + arena_size, MS_SYNC);
+    munmap(sh, STATE_HEADER + arena_size);
+    close(state_fd);
+  } else {
+    munmap(arena, arena_size);
+  }
+  while (config != &boot_config) {
+    struct Config *c = config;
+    config = c->prev;
+    free(c);
+  }
   printf("Server terminated.\n");
   return 0;
 }
+
+#endif // SERVER_NO_MAIN
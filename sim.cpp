@@ -0,0 +1,618 @@
+/*
+   Runs the server's request path against thousands of simulated clients in
+   one process. servermain.cpp is compiled into this file (without its
+   main()), as in bench, and its transport is replaced by an in-memory
+   network: every datagram a worker or client sends becomes a delivery
+   event, and a virtual clock jumps from one event to the next. Nothing
+   waits on real time, so a run goes as fast as the CPU allows, and the
+   same seed gives the same run: loss, delay jitter (which reorders
+   datagrams) and the clients' pacing are all drawn from it.
+
+   Clients speak the binary single-task protocol over UDP and retransmit
+   like the real client, with a fixed initial timeout doubled per attempt.
+   Client i is 10.0.0.0 + i and lands on worker i % workers, standing in
+   for the kernel's SO_REUSEPORT hash.
+*/
+
+#define SERVER_NO_MAIN
+#define SERVER_SIM
+#include "servermain.cpp"
+
+#include "clientproto.h"
+
+#define SIM_SOCK 0                 // every worker's one (pretend) socket
+#define SIM_CLIENTS_MAX (1 << 24)  // the 10.0.0.0/8 addresses
+#define SIM_PORT 4000
+#define SIM_PKT 64                 // largest datagram of the protocol used
+#define SIM_START_NS 1000000000ull // virtual time starts at 1 s, not 0
+#define SIM_RTO_MS 1000
+#define SIM_ATTEMPTS 3
+
+#define NO_TIMER UINT32_MAX
+
+enum { EV_SERVER, EV_CLIENT };
+
+/* A datagram on its way to a worker or to a client. */
+struct Event {
+  uint32_t client;
+  uint8_t kind;
+  uint16_t len;
+  char data[SIM_PKT];
+};
+
+struct HeapEntry {
+  uint64_t t_ns;
+  uint64_t seq; // ties go in scheduling order
+  uint32_t ev;
+};
+
+/* Datagrams that have reached one worker and wait for its next receive. */
+struct Inbox {
+  uint32_t *evs;
+  size_t head, tail, cap;
+};
+
+enum { C_IDLE, C_TASK, C_VERDICT, C_DONE };
+
+struct Client {
+  uint8_t state;
+  uint8_t attempt; // transmissions of out so far
+  uint8_t abandon; // takes tasks and never answers them
+  uint8_t hinted;  // the next send follows a retry-after hint
+  uint16_t len;
+  uint32_t timer_pos; // place in the timer heap, NO_TIMER if not armed
+  uint32_t sessions_left;
+  uint64_t timer_ns;
+  uint64_t started_ns;
+  char out[SIM_PKT]; // the message to retransmit
+};
+
+struct SimStats {
+  uint64_t sent, delivered, dropped;
+  uint64_t ok, not_ok, rejected, timed_out, abandoned, retransmits, hinted;
+  uint64_t stray; // replies a client was no longer waiting for
+};
+
+static uint64_t sim_ns = SIM_START_NS;
+static calcCtx net_rng;
+static double loss;       // per datagram, either way
+static uint64_t delay_ns; // one way
+static uint64_t jitter_ns;
+
+static struct Event *events;
+static uint32_t *free_evs;
+static size_t nfree, events_cap;
+static struct HeapEntry *heap;
+static size_t heap_len;
+static uint64_t next_seq;
+
+/* Clients with an armed timer, a heap by deadline. A client is in it at
+   most once and moves when rearmed, so the heap stays as small as the
+   client count however often timers are replaced. */
+static uint32_t *timers;
+static size_t ntimers;
+
+static struct Client *clients;
+static int nclients;
+static struct Worker **sim_workers;
+static int nworkers;
+static struct Inbox *inboxes;
+static struct SimStats ss;
+static uint32_t *latencies_us;
+static size_t nlatencies;
+static uint64_t think_ns;
+
+static double rand_unit(void) {
+  return (calc_ctx_u64(&net_rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t event_new(void) {
+  if (nfree == 0) {
+    size_t cap = events_cap ? events_cap * 2 : 4096;
+    events = (struct Event *)realloc(events, cap * sizeof(*events));
+    free_evs = (uint32_t *)realloc(free_evs, cap * sizeof(*free_evs));
+    heap = (struct HeapEntry *)realloc(heap, cap * sizeof(*heap));
+    if (!events || !free_evs || !heap) {
+      printf("ERROR: out of memory\n");
+      exit(1);
+    }
+    for (size_t i = cap; i > events_cap; i--)
+      free_evs[nfree++] = (uint32_t)(i - 1);
+    events_cap = cap;
+  }
+  return free_evs[--nfree];
+}
+
+static int heap_less(const struct HeapEntry *a, const struct HeapEntry *b) {
+  return a->t_ns != b->t_ns ? a->t_ns < b->t_ns : a->seq < b->seq;
+}
+
+static void heap_push(uint64_t t_ns, uint32_t ev) {
+  size_t i = heap_len++;
+  struct HeapEntry e = {t_ns, next_seq++, ev};
+  while (i > 0 && heap_less(&e, &heap[(i - 1) / 2])) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = e;
+}
+
+static struct HeapEntry heap_pop(void) {
+  struct HeapEntry top = heap[0], last = heap[--heap_len];
+  size_t i = 0;
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= heap_len)
+      break;
+    if (c + 1 < heap_len && heap_less(&heap[c + 1], &heap[c]))
+      c++;
+    if (!heap_less(&heap[c], &last))
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/* Puts a datagram on the network: lost, or delivered after the delay plus
+   up to the jitter. */
+static void net_send(int kind, uint32_t client, const void *data,
+                     size_t len) {
+  ss.sent++;
+  if (len > SIM_PKT || (loss > 0 && rand_unit() < loss)) {
+    ss.dropped++;
+    return;
+  }
+  uint64_t t = sim_ns + delay_ns;
+  if (jitter_ns)
+    t += calc_ctx_u64(&net_rng) % jitter_ns;
+  uint32_t e = event_new();
+  events[e].client = client;
+  events[e].kind = kind;
+  events[e].len = len;
+  memcpy(events[e].data, data, len);
+  heap_push(t, e);
+}
+
+static void client_addr(uint32_t i, struct sockaddr_storage *sa,
+                        socklen_t *len) {
+  struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+  memset(sa, 0, sizeof(*sa));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(0x0a000000u + i);
+  sin->sin_port = htons(SIM_PORT);
+  *len = sizeof(*sin);
+}
+
+/* Transport for the workers: replies go onto the network, and receives
+   take what has reached the worker's inbox. */
+static int mem_send(struct Worker *, struct PacketBatch *tx) {
+  for (int i = 0; i < tx->count; i++) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)&tx->addrs[i];
+    net_send(EV_CLIENT, ntohl(sin->sin_addr.s_addr) - 0x0a000000u,
+             tx->bufs[i], tx->iov[i].iov_len);
+  }
+  return tx->count;
+}
+
+static int mem_recv(struct Worker *w, int, struct PacketBatch *rx) {
+  struct Inbox *in = &inboxes[w->index];
+  int n = 0;
+  for (; n < rx->cap && in->head < in->tail; n++) {
+    struct Event *e = &events[in->evs[in->head++]];
+    memcpy(rx->bufs[n], e->data, e->len);
+    rx->msgs[n].msg_len = e->len;
+    client_addr(e->client, &rx->addrs[n], &rx->msgs[n].msg_hdr.msg_namelen);
+    free_evs[nfree++] = (uint32_t)(e - events);
+  }
+  if (in->head == in->tail)
+    in->head = in->tail = 0;
+  return n;
+}
+
+static uint64_t mem_clock_ns(int) { return sim_ns; }
+
+static const struct Transport mem_transport = {mem_send, mem_recv,
+                                               mem_clock_ns};
+
+static void inbox_put(uint32_t ev) {
+  struct Inbox *in = &inboxes[events[ev].client % nworkers];
+  if (in->tail == in->cap) {
+    in->cap = in->cap ? in->cap * 2 : 1024;
+    in->evs = (uint32_t *)realloc(in->evs, in->cap * sizeof(*in->evs));
+    if (!in->evs) {
+      printf("ERROR: out of memory\n");
+      exit(1);
+    }
+  }
+  in->evs[in->tail++] = ev;
+}
+
+static int timer_less(uint32_t a, uint32_t b) {
+  return clients[a].timer_ns != clients[b].timer_ns
+             ? clients[a].timer_ns < clients[b].timer_ns
+             : a < b;
+}
+
+static void timer_place(size_t pos, uint32_t i) {
+  timers[pos] = i;
+  clients[i].timer_pos = (uint32_t)pos;
+}
+
+/* Restores heap order around a client whose deadline changed. */
+static void timer_fix(uint32_t i) {
+  size_t pos = clients[i].timer_pos;
+  while (pos > 0 && timer_less(i, timers[(pos - 1) / 2])) {
+    timer_place(pos, timers[(pos - 1) / 2]);
+    pos = (pos - 1) / 2;
+  }
+  for (;;) {
+    size_t c = 2 * pos + 1;
+    if (c >= ntimers)
+      break;
+    if (c + 1 < ntimers && timer_less(timers[c + 1], timers[c]))
+      c++;
+    if (!timer_less(timers[c], i))
+      break;
+    timer_place(pos, timers[c]);
+    pos = c;
+  }
+  timer_place(pos, i);
+}
+
+static void disarm(uint32_t i) {
+  size_t pos = clients[i].timer_pos;
+  if (pos == NO_TIMER)
+    return;
+  clients[i].timer_pos = NO_TIMER;
+  uint32_t last = timers[--ntimers];
+  if (last != i) {
+    timer_place(pos, last);
+    timer_fix(last);
+  }
+}
+
+static void arm(uint32_t i, uint64_t after_ns) {
+  struct Client *c = &clients[i];
+  c->timer_ns = sim_ns + after_ns;
+  if (c->timer_pos == NO_TIMER)
+    timer_place(ntimers++, i);
+  timer_fix(i);
+}
+
+static void transmit(uint32_t i) {
+  struct Client *c = &clients[i];
+  if (c->attempt++ > 0 && !c->hinted)
+    ss.retransmits++;
+  c->hinted = 0;
+  net_send(EV_SERVER, i, c->out, c->len);
+  arm(i, (uint64_t)SIM_RTO_MS * 1000000 << (c->attempt - 1));
+}
+
+static void session_start(uint32_t i) {
+  struct Client *c = &clients[i];
+  struct calcMessage m;
+  build_init_msg(&m);
+  memcpy(c->out, &m, sizeof(m));
+  c->len = sizeof(m);
+  c->attempt = 0;
+  c->state = C_TASK;
+  c->started_ns = sim_ns;
+  transmit(i);
+}
+
+/* Next session after a think time, or done. */
+static void session_end(uint32_t i) {
+  struct Client *c = &clients[i];
+  if (--c->sessions_left == 0) {
+    c->state = C_DONE;
+    disarm(i);
+    return;
+  }
+  c->state = C_IDLE;
+  arm(i, think_ns ? calc_ctx_u64(&net_rng) % (2 * think_ns) : 0);
+}
+
+static void client_timer(uint32_t i) {
+  struct Client *c = &clients[i];
+  if (c->state == C_IDLE) {
+    session_start(i);
+  } else if (c->attempt < SIM_ATTEMPTS) {
+    transmit(i);
+  } else {
+    ss.timed_out++;
+    session_end(i);
+  }
+}
+
+static void client_recv(uint32_t i, const char *data, size_t len) {
+  struct Client *c = &clients[i];
+  if (c->state == C_TASK && len == sizeof(struct calcProtocol)) {
+    if (c->abandon) {
+      ss.abandoned++;
+      session_end(i);
+      return;
+    }
+    struct calcProtocol task;
+    decode_task(data, &task);
+    calculate(&task);
+    encode_reply(&task, c->out);
+    c->len = sizeof(struct calcProtocol);
+    c->attempt = 0;
+    c->state = C_VERDICT;
+    transmit(i);
+  } else if (c->state == C_TASK && decode_verdict(data, len) == 2) {
+    uint32_t after = decode_retry_after(data, len);
+    if (after && c->attempt < SIM_ATTEMPTS) {
+      /* Come back later: the timer sends the request again, within the
+         same session and attempt budget, as the real client does. */
+      ss.hinted++;
+      c->hinted = 1;
+      arm(i, (uint64_t)after * 1000000);
+      return;
+    }
+    ss.rejected++;
+    session_end(i);
+  } else if (c->state == C_VERDICT && decode_verdict(data, len) != 0) {
+    if (decode_verdict(data, len) == 1)
+      ss.ok++;
+    else
+      ss.not_ok++;
+    latencies_us[nlatencies++] = (uint32_t)((sim_ns - c->started_ns) / 1000);
+    session_end(i);
+  } else {
+    ss.stray++;
+  }
+}
+
+static int by_value(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double p) {
+  if (nlatencies == 0)
+    return 0.0;
+  size_t i = (size_t)(p * (nlatencies - 1));
+  return latencies_us[i] / 1000.0;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options]\n"
+         "  -c N    clients (default 1000)\n"
+         "  -n N    sessions per client (default 10)\n"
+         "  -t MS   mean think time between a client's sessions (default 10)\n"
+         "  -A PCT  clients that never answer their tasks\n"
+         "  -w N    server workers (default 1)\n"
+         "  -m N    server sessions across all workers (default %d)\n"
+         "  -q MS   server --queue-delay\n"
+         "  -a MS   server --retry-after\n"
+         "  -S      server --stateless\n"
+         "  -d US   one-way network delay (default 100)\n"
+         "  -j US   extra random delay per datagram, reorders (default 0)\n"
+         "  -l PCT  datagrams lost, each way\n"
+         "  -s N    seed (default 1)\n"
+         "  -T S    stop after S seconds of virtual time (default 3600)\n",
+         prog, MAX_SESSIONS_DEFAULT);
+}
+
+int main(int argc, char *argv[]) {
+  long sessions = 10, max_sessions = MAX_SESSIONS_DEFAULT;
+  double abandon = 0.0, limit_s = 3600.0;
+  uint64_t seed = 1;
+  nclients = 1000;
+  nworkers = 1;
+  think_ns = 10 * 1000000ull;
+  delay_ns = 100 * 1000ull;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:t:A:w:m:q:a:Sd:j:l:s:T:")) != -1) {
+    switch (opt) {
+    case 'c':
+      nclients = atoi(optarg);
+      break;
+    case 'n':
+      sessions = atol(optarg);
+      break;
+    case 't':
+      think_ns = (uint64_t)(atof(optarg) * 1e6);
+      break;
+    case 'A':
+      abandon = atof(optarg) / 100.0;
+      break;
+    case 'w':
+      nworkers = atoi(optarg);
+      break;
+    case 'm':
+      max_sessions = atol(optarg);
+      break;
+    case 'q':
+      boot_config.queue_delay_ms = atoi(optarg);
+      break;
+    case 'a':
+      boot_config.retry_after_ms = atoi(optarg);
+      break;
+    case 'S':
+      stateless = 1;
+      break;
+    case 'd':
+      delay_ns = (uint64_t)(atof(optarg) * 1e3);
+      break;
+    case 'j':
+      jitter_ns = (uint64_t)(atof(optarg) * 1e3);
+      break;
+    case 'l':
+      loss = atof(optarg) / 100.0;
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      limit_s = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc || nclients < 1 || nclients > SIM_CLIENTS_MAX ||
+      sessions < 1 || sessions > UINT32_MAX / nclients || nworkers < 1 ||
+      nworkers > MAX_THREADS || max_sessions < 1 ||
+      max_sessions > MAX_SESSIONS_LIMIT ||
+      boot_config.queue_delay_ms > boot_config.timeout_ms ||
+      boot_config.retry_after_ms > RETRY_AFTER_MAX || loss < 0 || loss > 1 ||
+      abandon < 0 || abandon > 1 || limit_s <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  transport = &mem_transport;
+  calc_ctx_init(&net_rng, seed);
+  cookie_key[0] = calc_ctx_u64(&net_rng);
+  cookie_key[1] = calc_ctx_u64(&net_rng);
+
+  /* The server's shards, laid out as main() in servermain.cpp does. */
+  int per_shard = (int)((max_sessions + nworkers - 1) / nworkers);
+  uint32_t bucket_mask;
+  size_t shard_size = shard_bytes(per_shard, &bucket_mask);
+  size_t arena_size = shard_size * nworkers;
+  int huge;
+  char *arena = (char *)arena_alloc(&arena_size, 0, &huge);
+  sim_workers = (struct Worker **)calloc(nworkers + 1, sizeof(*sim_workers));
+  inboxes = (struct Inbox *)calloc(nworkers, sizeof(*inboxes));
+  clients = (struct Client *)calloc(nclients, sizeof(*clients));
+  timers = (uint32_t *)malloc(nclients * sizeof(*timers));
+  latencies_us = (uint32_t *)malloc(nclients * sessions * sizeof(uint32_t));
+  if (!arena || !sim_workers || !inboxes || !clients || !timers ||
+      !latencies_us) {
+    printf("ERROR: out of memory\n");
+    return 1;
+  }
+  for (int t = 0; t < nworkers; t++) {
+    sim_workers[t] = worker_create(t, nworkers, per_shard, bucket_mask,
+                                   arena + shard_size * t, BATCH_DEFAULT,
+                                   calc_ctx_u64(&net_rng));
+    if (!sim_workers[t]) {
+      printf("ERROR: worker setup failed\n");
+      return 1;
+    }
+  }
+  all_workers = sim_workers;
+  worker_count = nworkers;
+  started_ms = now_ms();
+
+  /* Clients start spread over one think time. */
+  for (int i = 0; i < nclients; i++) {
+    clients[i].timer_pos = NO_TIMER;
+    clients[i].sessions_left = sessions;
+    clients[i].abandon = abandon > 0 && rand_unit() < abandon;
+    arm(i, think_ns ? calc_ctx_u64(&net_rng) % think_ns : 0);
+  }
+
+  printf("Simulating %d clients x %ld sessions against %d worker%s, "
+         "%d sessions each, seed %llu\n",
+         nclients, sessions, nworkers, nworkers == 1 ? "" : "s", per_shard,
+         (unsigned long long)seed);
+  printf("Network: %.0f us delay, %.0f us jitter, %.2f%% loss\n",
+         delay_ns / 1e3, jitter_ns / 1e3, loss * 100);
+
+  uint64_t limit_ns = SIM_START_NS + (uint64_t)(limit_s * 1e9);
+  uint64_t wall0 = udp_clock_ns(0);
+  while (sim_ns < limit_ns) {
+    /* Jump to whatever comes first: a datagram or client timer, or a
+       worker's wheel tick or waiter deadline. */
+    uint64_t next = heap_len ? heap[0].t_ns : UINT64_MAX;
+    if (ntimers && clients[timers[0]].timer_ns < next)
+      next = clients[timers[0]].timer_ns;
+    for (int t = 0; t < nworkers; t++) {
+      uint64_t d = worker_deadline_ms(sim_workers[t]) * 1000000;
+      if (d && d < next)
+        next = d;
+    }
+    if (next == UINT64_MAX)
+      break; // every client is done and the table is empty
+    if (next > sim_ns)
+      sim_ns = next;
+
+    for (int t = 0; t < nworkers; t++) {
+      uint64_t d = worker_deadline_ms(sim_workers[t]);
+      if (d && d * 1000000 <= sim_ns)
+        worker_tick(sim_workers[t]);
+    }
+    while (heap_len && heap[0].t_ns <= sim_ns) {
+      uint32_t e = heap_pop().ev;
+      struct Event *ev = &events[e];
+      ss.delivered++;
+      if (ev->kind == EV_SERVER) {
+        inbox_put(e); // freed once the worker has read it
+        continue;
+      }
+      client_recv(ev->client, ev->data, ev->len);
+      free_evs[nfree++] = e;
+    }
+    while (ntimers && clients[timers[0]].timer_ns <= sim_ns) {
+      uint32_t i = timers[0];
+      disarm(i);
+      client_timer(i);
+    }
+    for (int t = 0; t < nworkers; t++) {
+      struct Worker *w = sim_workers[t];
+      while (inboxes[t].tail > inboxes[t].head)
+        worker_receive(w, SIM_SOCK);
+      /* The generator thread's job, done in line so the run stays on one
+         thread and repeatable. */
+      if (w->pool.refill_pending) {
+        pool_refill(&w->pool);
+        w->pool.refill_pending = 0;
+      }
+    }
+  }
+  double wall = (udp_clock_ns(0) - wall0) / 1e9;
+  double virt = (sim_ns - SIM_START_NS) / 1e9;
+
+  int unfinished = 0;
+  for (int i = 0; i < nclients; i++)
+    unfinished += clients[i].state != C_DONE;
+  qsort(latencies_us, nlatencies, sizeof(*latencies_us), by_value);
+
+  struct Stats st;
+  memset(&st, 0, sizeof(st));
+  for (int t = 0; t < nworkers; t++) {
+    const struct Stats *o = &sim_workers[t]->stats;
+    st.assigned += o->assigned;
+    st.ok += o->ok;
+    st.failed += o->failed;
+    st.expired += o->expired;
+    st.rejected += o->rejected;
+    st.active += o->active;
+  }
+
+  printf("Virtual time %.3f s, %llu datagrams sent, %llu delivered, %llu "
+         "lost\n",
+         virt, (unsigned long long)ss.sent, (unsigned long long)ss.delivered,
+         (unsigned long long)ss.dropped);
+  printf("Clients: %llu OK, %llu NOT OK, %llu turned away, %llu timed out, "
+         "%llu abandoned, %d unfinished\n",
+         (unsigned long long)ss.ok, (unsigned long long)ss.not_ok,
+         (unsigned long long)ss.rejected, (unsigned long long)ss.timed_out,
+         (unsigned long long)ss.abandoned, unfinished);
+  printf("         %llu retransmissions, %llu retry-after waits, %llu stray "
+         "replies\n",
+         (unsigned long long)ss.retransmits, (unsigned long long)ss.hinted,
+         (unsigned long long)ss.stray);
+  printf("Session time: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+         percentile_ms(0.5), percentile_ms(0.99), percentile_ms(1.0));
+  printf("Server: %llu assigned, %llu OK, %llu failed, %llu expired, %llu "
+         "rejected, %llu active\n",
+         (unsigned long long)st.assigned, (unsigned long long)st.ok,
+         (unsigned long long)st.failed, (unsigned long long)st.expired,
+         (unsigned long long)st.rejected, (unsigned long long)st.active);
+  fflush(stdout);
+  /* Wall clock figures differ from run to run; keep them off stdout so two
+     runs with one seed can be compared with diff. */
+  fprintf(stderr, "Wall time %.3f s, %.2f M datagrams/s, %.1fx real time\n",
+          wall, wall > 0 ? ss.delivered / wall / 1e6 : 0.0,
+          wall > 0 ? virt / wall : 0.0);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef __SIPHASH
+#define __SIPHASH
+
+/*
+   SipHash-2-4 (Aumasson and Bernstein): a keyed 64-bit MAC that is fast on
+   short inputs. The server uses it to sign the task cookies of its
+   stateless mode.
+*/
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3)                                          \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = SIPHASH_ROTL(v1, 13);                                                 \
+    v1 ^= v0;                                                                  \
+    v0 = SIPHASH_ROTL(v0, 32);                                                 \
+    v2 += v3;                                                                  \
+    v3 = SIPHASH_ROTL(v3, 16);                                                 \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = SIPHASH_ROTL(v3, 21);                                                 \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = SIPHASH_ROTL(v1, 17);                                                 \
+    v1 ^= v2;                                                                  \
+    v2 = SIPHASH_ROTL(v2, 32);                                                 \
+  } while (0)
+
+/* MAC of len bytes at data under the 128-bit key k (little-endian words,
+   as in the reference implementation). */
+static inline uint64_t siphash24(const uint64_t k[2], const void *data,
+                                 size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t v0 = 0x736f6d6570736575ull ^ k[0];
+  uint64_t v1 = 0x646f72616e646f6dull ^ k[1];
+  uint64_t v2 = 0x6c7967656e657261ull ^ k[0];
+  uint64_t v3 = 0x7465646279746573ull ^ k[1];
+  uint64_t b = (uint64_t)len << 56;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t m;
+    memcpy(&m, p, sizeof(m));
+    m = le64toh(m);
+    v3 ^= m;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  for (size_t i = 0; i < len; i++)
+    b |= (uint64_t)p[i] << (8 * i);
+
+  v3 ^= b;
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPHASH_ROUND
+#undef SIPHASH_ROTL
+
+#endif
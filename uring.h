@@ -0,0 +1,201 @@
+#ifndef __URING
+#define __URING
+
+/*
+   Just enough io_uring for the server, on the raw system calls (no
+   liburing): ring setup, taking and submitting SQEs, reading CQEs, and a
+   provided buffer ring for multishot receives. One thread owns a ring;
+   nothing here locks.
+*/
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct Uring {
+  int fd; // -1 when not in use
+  unsigned *sq_head, *sq_tail, *sq_array;
+  unsigned sq_mask, sq_entries;
+  unsigned sq_local; // tail including SQEs not yet published
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *rings;
+  size_t rings_size, sqes_size;
+};
+
+/* Receive buffers the kernel picks from, bid = index into mem. */
+struct UringBufs {
+  struct io_uring_buf_ring *ring;
+  char *mem;
+  unsigned entries; // power of two
+  unsigned size;    // bytes per buffer
+  uint16_t tail;
+  size_t ring_bytes;
+};
+
+/* Ring with the given SQ/CQ sizes, set up for a single submitting thread
+   that reaps its own completions. Returns -1 with errno set on failure. */
+static inline int uring_init(struct Uring *r, unsigned entries,
+                             unsigned cq_entries) {
+  static const unsigned flag_sets[] = {
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+      IORING_SETUP_COOP_TASKRUN, 0};
+  struct io_uring_params p;
+  r->fd = -1;
+  for (size_t i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]); i++) {
+    memset(&p, 0, sizeof(p));
+    p.flags = flag_sets[i] | IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd >= 0 || errno != EINVAL)
+      break;
+  }
+  if (r->fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(r->fd);
+    r->fd = -1;
+    errno = ENOSYS;
+    return -1;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, r->fd,
+                                        IORING_OFF_SQES);
+  if (r->rings == MAP_FAILED || r->sqes == MAP_FAILED) {
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+  }
+
+  char *base = (char *)r->rings;
+  r->sq_head = (unsigned *)(base + p.sq_off.head);
+  r->sq_tail = (unsigned *)(base + p.sq_off.tail);
+  r->sq_array = (unsigned *)(base + p.sq_off.array);
+  r->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_local = *r->sq_tail;
+  r->cq_head = (unsigned *)(base + p.cq_off.head);
+  r->cq_tail = (unsigned *)(base + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+  return 0;
+}
+
+static inline void uring_exit(struct Uring *r) {
+  if (r->fd < 0)
+    return;
+  munmap(r->sqes, r->sqes_size);
+  munmap(r->rings, r->rings_size);
+  close(r->fd);
+  r->fd = -1;
+}
+
+/* A zeroed SQE to fill in, or NULL if the SQ is full (submit first). */
+static inline struct io_uring_sqe *uring_sqe(struct Uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (r->sq_local - head >= r->sq_entries)
+    return NULL;
+  unsigned idx = r->sq_local++ & r->sq_mask;
+  r->sq_array[idx] = idx;
+  memset(&r->sqes[idx], 0, sizeof(r->sqes[idx]));
+  return &r->sqes[idx];
+}
+
+/* Submits everything taken so far and waits until at least wait_nr CQEs
+   are ready. */
+static inline int uring_enter(struct Uring *r, unsigned wait_nr) {
+  __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+  unsigned submit =
+      r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  int ret;
+  do
+    ret = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait_nr,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+  while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+static inline unsigned uring_cq_ready(const struct Uring *r) {
+  return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+}
+
+/* The i-th ready CQE, counting from the head. */
+static inline struct io_uring_cqe *uring_cqe(struct Uring *r, unsigned i) {
+  return &r->cqes[(*r->cq_head + i) & r->cq_mask];
+}
+
+static inline void uring_cq_advance(struct Uring *r, unsigned n) {
+  __atomic_store_n(r->cq_head, *r->cq_head + n, __ATOMIC_RELEASE);
+}
+
+/* Hands buffer bid back to the kernel; visible after uring_bufs_publish(). */
+static inline void uring_buf_put(struct UringBufs *b, uint16_t bid) {
+  /* Not b->ring->bufs: in C++ the empty struct before that flexible array
+     takes a byte and shifts it off the kernel's layout. */
+  struct io_uring_buf *e =
+      (struct io_uring_buf *)b->ring + (b->tail & (b->entries - 1));
+  e->addr = (uint64_t)(uintptr_t)(b->mem + (size_t)bid * b->size);
+  e->len = b->size;
+  e->bid = bid;
+  b->tail++;
+}
+
+static inline void uring_bufs_publish(struct UringBufs *b) {
+  __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+/* Registers entries buffers of size bytes as buffer group bgid. */
+static inline int uring_bufs_init(struct Uring *r, struct UringBufs *b,
+                                  uint16_t bgid, unsigned entries,
+                                  unsigned size) {
+  b->entries = entries;
+  b->size = size;
+  b->tail = 0;
+  b->ring_bytes = entries * sizeof(struct io_uring_buf);
+  b->ring = (struct io_uring_buf_ring *)mmap(
+      NULL, b->ring_bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  b->mem = (char *)mmap(NULL, (size_t)entries * size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (b->ring == MAP_FAILED || b->mem == MAP_FAILED)
+    return -1;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0)
+    return -1;
+  for (unsigned i = 0; i < entries; i++)
+    uring_buf_put(b, (uint16_t)i);
+  uring_bufs_publish(b);
+  return 0;
+}
+
+static inline void uring_bufs_free(struct UringBufs *b) {
+  if (b->ring && b->ring != MAP_FAILED)
+    munmap(b->ring, b->ring_bytes);
+  if (b->mem && b->mem != MAP_FAILED)
+    munmap(b->mem, (size_t)b->entries * b->size);
+  b->ring = NULL;
+  b->mem = NULL;
+}
+
+#endif